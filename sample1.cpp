@@ -1,6 +1,33 @@
 #include <memory>
+#include <functional>
 #include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <list>
+#include <regex>
+#include <tuple>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 #include <sqlite3.h>
 
   template< bool B, class T = void >
@@ -255,8 +282,11 @@ void parameter(not_null<sqlite3_stmt*> stmt,
 
 struct Transaction
 {
-  Transaction(not_null<sqlite3*> db) : _db{db}{
-    execute(_db, "BEGIN TRANSACTION;") ;
+  // immediate takes the write lock up front, which a busy timeout can wait
+  // for, instead of failing on the first write of a read transaction
+  Transaction(not_null<sqlite3*> db, bool immediate = false) : _db{db}{
+    execute(_db, immediate ? "BEGIN IMMEDIATE TRANSACTION;"
+                           : "BEGIN TRANSACTION;") ;
   }
   ~Transaction() {
     if(_db) execute(_db, "ROLLBACK TRANSACTION;") ;
@@ -275,6 +305,28 @@ struct Transaction
 private:  sqlite3* _db ;
 };
 
+// like Transaction, but nests: inside a transaction of the caller it is
+// part of that one, outside of one it is a transaction of its own
+struct Savepoint
+{
+  Savepoint(not_null<sqlite3*> db, const std::string& name) : _db{db}, _name{name}{
+    execute(_db, ("SAVEPOINT " + _name + ";").c_str()) ;
+  }
+  ~Savepoint() {
+    if(_db) execute(_db, ("ROLLBACK TO " + _name + "; RELEASE " + _name + ";").c_str()) ;
+  }
+  void release() {
+    if(_db) execute(_db, ("RELEASE " + _name + ";").c_str()) ;
+    _db = nullptr ;
+  }
+
+  Savepoint (Savepoint&) =  delete ;
+  Savepoint& operator=(Savepoint&) =  delete ;
+
+private:  sqlite3* _db ;
+          std::string _name ;
+};
+
 constexpr const char* create_things()
 {
   return R"~(BEGIN TRANSACTION ;
@@ -322,8 +374,5689 @@ void main1()
 }
 
 
+int64_t query_int64(not_null<sqlite3*> db, const std::string& sql)
+{
+  int64_t result = 0 ;
+  auto stmt = create_statement(db, sql);
+  run(stmt.get(), [&](not_null<sqlite3_stmt*> row) {
+    result = sqlite3_column_int64(row, 0);
+    return false ;
+  });
+  return result ;
+}
+
+// first column of the first row, false if there is none or it is NULL
+bool fetch_int64(not_null<sqlite3_stmt*> stmt, int64_t& result)
+{
+  bool found = false ;
+  run(stmt, [&](not_null<sqlite3_stmt*> row) {
+    found = sqlite3_column_type(row, 0) != SQLITE_NULL ;
+    result = sqlite3_column_int64(row, 0);
+    return false ;
+  });
+  return found ;
+}
+
+
+//
+// background wal checkpoints
+//
+// a writer connection attached to the checkpointer gets its wal hook
+// replaced, which switches off its auto checkpoint, so no random commit
+// has to pay for a checkpoint anymore.
+// checkpoints run on an own connection, PASSIVE once the writers have
+// been quiet for a while, RESTART/TRUNCATE when the wal grows too big.
+//
+struct checkpoint_stats
+{
+  int mode = SQLITE_CHECKPOINT_PASSIVE ;
+  int rc = SQLITE_OK ;
+  int wal_frames = 0 ;    // frames left in the wal after the checkpoint
+  int moved_frames = 0 ;  // frames copied back into the database
+  int64_t wal_bytes = 0 ;
+  std::chrono::microseconds duration{0} ;
+};
+
+struct checkpoint_settings
+{
+  std::chrono::milliseconds idle{200} ;  // quiet time before a PASSIVE run
+  std::chrono::milliseconds poll{50} ;
+  int restart_frames = 4000 ;   // RESTART, don't wait for idle anymore
+  int truncate_frames = 16000 ; // TRUNCATE, gives the disk space back
+  int busy_timeout_ms = 100 ;   // how long RESTART/TRUNCATE wait for readers
+};
+
+const char* checkpoint_mode_name(int mode)
+{
+  switch (mode) {
+    case SQLITE_CHECKPOINT_PASSIVE: return "PASSIVE" ;
+    case SQLITE_CHECKPOINT_FULL: return "FULL" ;
+    case SQLITE_CHECKPOINT_RESTART: return "RESTART" ;
+    case SQLITE_CHECKPOINT_TRUNCATE: return "TRUNCATE" ;
+  }
+  return "?" ;
+}
+
+class wal_checkpointer
+{
+public:
+  using report_callback = std::function<void(const checkpoint_stats&)> ;
+
+  wal_checkpointer(const std::string& filename,
+                   checkpoint_settings settings = checkpoint_settings{},
+                   report_callback report = report_callback{})
+  : _db{open_database(filename.c_str())}
+  , _settings(settings)
+  , _report(report)
+  {
+    execute(_db.get(), "PRAGMA journal_mode=WAL;");
+    sqlite3_busy_timeout(_db.get(), _settings.busy_timeout_ms);
+    _page_size = query_int64(_db.get(), "PRAGMA page_size;");
+    _thread = std::thread(&wal_checkpointer::loop, this);
+  }
+
+  ~wal_checkpointer() { stop(); }
+
+  // the checkpointer has to outlive the attachment, call detach before
+  void attach(not_null<sqlite3*> db) {
+    auto pages = query_int64(db, "PRAGMA wal_autocheckpoint;");
+    { std::lock_guard<std::mutex> lock(_mutex);
+      _autocheckpoint[db] = int(pages) ;
+    }
+    sqlite3_wal_hook(db, &wal_checkpointer::on_commit, this);
+  }
+
+  // gives the connection the auto checkpoint back it had before attach
+  void detach(not_null<sqlite3*> db) {
+    int pages = 1000 ;
+    { std::lock_guard<std::mutex> lock(_mutex);
+      auto attached = _autocheckpoint.find(db) ;
+      if (attached == _autocheckpoint.end()) return ;
+      pages = attached->second ;
+      _autocheckpoint.erase(attached);
+    }
+    sqlite3_wal_autocheckpoint(db, pages);
+  }
+
+  void stop() {
+    { std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true ;
+    }
+    _wakeup.notify_one();
+    if (_thread.joinable()) _thread.join();
+  }
+
+  checkpoint_stats last() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _last ;
+  }
+
+  wal_checkpointer (wal_checkpointer&) = delete ;
+  wal_checkpointer& operator=(wal_checkpointer&) = delete ;
+
+private:
+  static int on_commit(void* self, sqlite3*, const char*, int frames) {
+    auto cp = static_cast<wal_checkpointer*>(self);
+    bool escalate = false ;
+    { std::lock_guard<std::mutex> lock(cp->_mutex);
+      if (frames < cp->_wal_frames) ++cp->_wal_generation ;
+      cp->_wal_frames = frames ;
+      cp->_frames = frames ;
+      cp->_dirty = true ;
+      cp->_last_commit = std::chrono::steady_clock::now();
+      escalate = frames >= cp->_settings.restart_frames ;
+    }
+    if (escalate) cp->_wakeup.notify_one();
+    return SQLITE_OK ;
+  }
+
+  int next_mode() const {
+    if (not _dirty) return -1 ;
+    if (_frames >= _settings.truncate_frames)
+      return SQLITE_CHECKPOINT_TRUNCATE ;
+    if (_frames >= _settings.restart_frames)
+      return SQLITE_CHECKPOINT_RESTART ;
+    if (std::chrono::steady_clock::now() - _last_commit >= _settings.idle)
+      return SQLITE_CHECKPOINT_PASSIVE ;
+    return -1 ;
+  }
+
+  checkpoint_stats checkpoint(int mode, int frames_before) {
+    checkpoint_stats stats ;
+    stats.mode = mode ;
+    int log = 0, ckpt = 0 ;
+    auto start = std::chrono::steady_clock::now();
+    stats.rc = sqlite3_wal_checkpoint_v2(_db.get(), "main", mode, &log, &ckpt);
+    stats.duration = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+    stats.wal_frames = log ;
+    // a truncated wal reports 0/0, everything it had was moved
+    stats.moved_frames = (stats.rc == SQLITE_OK && log == 0) ? frames_before
+                                                             : ckpt ;
+    stats.wal_bytes = log > 0 ? 32 + int64_t{log} * (_page_size + 24) : 0 ;
+    return stats ;
+  }
+
+  void loop() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (not _stop) {
+      _wakeup.wait_for(lock, _settings.poll);
+      auto mode = next_mode();
+      if (_stop || mode < 0) continue ;
+
+      auto frames_before = _frames ;
+      _dirty = false ;
+      const auto generation = _wal_generation ;
+      lock.unlock();
+      auto stats = checkpoint(mode, frames_before);
+      if (_report) _report(stats);
+      lock.lock();
+
+      // readers kept us from getting everything, try again later
+      if (stats.rc != SQLITE_OK || stats.moved_frames < stats.wal_frames)
+        _dirty = true ;
+      else {
+        // the wal starts over, only commits that came in meanwhile are left
+        if (mode != SQLITE_CHECKPOINT_PASSIVE)
+          _frames = std::max(0, _frames - frames_before) ;
+        // commits that ended while it ran may still be in it, if the wal
+        // has not started over since and their frames are all moved
+        if (_wal_generation == generation && _wal_frames <= stats.wal_frames)
+          _dirty = false ;
+      }
+      _last = stats ;
+    }
+  }
+
+  database _db ;
+  checkpoint_settings _settings ;
+  report_callback _report ;
+  int64_t _page_size = 0 ;
+
+  mutable std::mutex _mutex ;
+  std::condition_variable _wakeup ;
+  bool _stop = false ;
+  bool _dirty = false ;
+  int _frames = 0 ;
+  int _wal_frames = 0 ;       // as the last commit reported them
+  int _wal_generation = 0 ;   // counts the times the wal started over
+  std::chrono::steady_clock::time_point _last_commit ;
+  checkpoint_stats _last ;
+  std::unordered_map<sqlite3*, int> _autocheckpoint ;
+  std::thread _thread ;
+};
+
+
+void remove_database(const std::string& name)
+{
+  std::remove(name.c_str());
+  std::remove((name + "-wal").c_str());
+  std::remove((name + "-shm").c_str());
+  std::remove((name + "-journal").c_str());
+}
+
+
+void main2()
+{
+  const std::string filename = "wal_sample.db" ;
+  remove_database(filename);
+
+  auto db = open_database(filename.c_str());
+  execute(db.get(), "PRAGMA journal_mode=WAL;");
+  execute(db.get(), "CREATE TABLE things(id INTEGER PRIMARY KEY, name TEXT,value REAL);");
+
+  checkpoint_settings settings ;
+  settings.restart_frames = 200 ;
+  settings.truncate_frames = 400 ;
+  auto report = [](const checkpoint_stats& s) {
+    std::cout << "checkpoint " << checkpoint_mode_name(s.mode)
+              << " rc=" << s.rc << " wal=" << s.wal_frames << " frames/"
+              << s.wal_bytes << " bytes, moved=" << s.moved_frames
+              << ", took " << s.duration.count() << "us\n" ;
+  };
+  wal_checkpointer checkpointer(filename, settings, report);
+  execute(db.get(), "PRAGMA wal_autocheckpoint=500;");
+  checkpointer.attach(db.get());
+
+  auto add_thing = create_statement(db.get(),
+        "INSERT INTO things(name, value) VALUES(@name,@value);");
+  for (int burst = 0; burst < 3; ++burst) {
+    for (int i = 0; i < 100 * (burst + 1); ++i) {
+      Transaction transaction(db.get()) ;
+      parameter(add_thing.get(), 1, std::string(200, 'x')) ;
+      parameter(add_thing.get(), 2, double(i)) ;
+      run(add_thing.get());
+      transaction.commit() ;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(400));
+  }
+
+  checkpointer.detach(db.get());
+  std::cout << "wal_autocheckpoint after detach "
+            << query_int64(db.get(), "PRAGMA wal_autocheckpoint;") << "\n" ;
+  checkpointer.stop();
+  add_thing.reset();
+  db.reset();
+  remove_database(filename);
+}
+
+
+//
+// incremental vacuum
+//
+// with auto_vacuum=INCREMENTAL deleted pages stay on the freelist until
+// someone asks for them with PRAGMA incremental_vacuum(N).
+// this runs that in small steps on an own connection, only while no one
+// else writes (PRAGMA data_version does not change), and adapts N so a
+// step stays inside its time budget.
+//
+struct vacuum_settings
+{
+  std::chrono::milliseconds idle{500} ;       // quiet time before we start
+  std::chrono::milliseconds poll{100} ;
+  std::chrono::milliseconds step_budget{20} ; // write lock time per step
+  double min_free_ratio = 0.1 ;  // freelist_count / page_count to start with
+  int64_t min_free_pages = 16 ;
+  int busy_timeout_ms = 50 ;
+};
+
+struct vacuum_stats
+{
+  int64_t page_count = 0 ;
+  int64_t freelist_count = 0 ;
+  int64_t pages_freed = 0 ;
+  int steps = 0 ;
+  std::chrono::microseconds duration{0} ;
+};
+
+// auto_vacuum can only change on an empty database or with a full VACUUM,
+// pay that once here if required
+void enable_incremental_vacuum(not_null<sqlite3*> db)
+{
+  if (query_int64(db, "PRAGMA auto_vacuum;") == 2) return ;
+  execute(db, "PRAGMA auto_vacuum=INCREMENTAL;");
+  if (query_int64(db, "PRAGMA auto_vacuum;") != 2) execute(db, "VACUUM;");
+}
+
+class incremental_vacuum
+{
+public:
+  using report_callback = std::function<void(const vacuum_stats&)> ;
+
+  incremental_vacuum(const std::string& filename,
+                     vacuum_settings settings = vacuum_settings{},
+                     report_callback report = report_callback{})
+  : _db{open_database(filename.c_str())}
+  , _settings(settings)
+  , _report(report)
+  {
+    sqlite3_busy_timeout(_db.get(), _settings.busy_timeout_ms);
+    enable_incremental_vacuum(_db.get());
+    _data_version = query_int64(_db.get(), "PRAGMA data_version;");
+    _last_activity = std::chrono::steady_clock::now();
+    _thread = std::thread(&incremental_vacuum::loop, this);
+  }
+
+  ~incremental_vacuum() { stop(); }
+
+  void stop() {
+    { std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true ;
+    }
+    _wakeup.notify_one();
+    if (_thread.joinable()) _thread.join();
+  }
+
+  vacuum_stats last() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _last ;
+  }
+
+  incremental_vacuum (incremental_vacuum&) = delete ;
+  incremental_vacuum& operator=(incremental_vacuum&) = delete ;
+
+private:
+  bool idle() {
+    auto version = query_int64(_db.get(), "PRAGMA data_version;");
+    auto now = std::chrono::steady_clock::now();
+    if (version != _data_version) {
+      _data_version = version ;
+      _last_activity = now ;
+    }
+    return now - _last_activity >= _settings.idle ;
+  }
+
+  bool worth_it(int64_t pages, int64_t free_pages) const {
+    return free_pages >= _settings.min_free_pages
+        && free_pages >= _settings.min_free_ratio * pages ;
+  }
+
+  // one short write transaction, returns false if we did not get the lock
+  bool step(vacuum_stats& stats) {
+    auto sql = "PRAGMA incremental_vacuum(" + std::to_string(_pages_per_step)
+             + ");" ;
+    auto before = stats.freelist_count ;
+    auto start = std::chrono::steady_clock::now();
+    auto rc = sqlite3_exec(_db.get(), sql.c_str(), 0, 0, 0);
+    auto took = std::chrono::steady_clock::now() - start ;
+    if (rc != SQLITE_OK) return false ;
+
+    stats.freelist_count = query_int64(_db.get(), "PRAGMA freelist_count;");
+    stats.page_count = query_int64(_db.get(), "PRAGMA page_count;");
+    stats.pages_freed += before - stats.freelist_count ;
+    stats.duration += std::chrono::duration_cast<std::chrono::microseconds>(took);
+    ++stats.steps ;
+
+    if (took > _settings.step_budget && _pages_per_step > 1)
+      _pages_per_step /= 2 ;
+    else if (took < _settings.step_budget / 2 && _pages_per_step < (1 << 16))
+      _pages_per_step *= 2 ;
+    return true ;
+  }
+
+  void loop() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (not _stop) {
+      _wakeup.wait_for(lock, _settings.poll);
+      if (_stop) break ;
+      lock.unlock();
+
+      vacuum_stats stats ;
+      stats.page_count = query_int64(_db.get(), "PRAGMA page_count;");
+      stats.freelist_count = query_int64(_db.get(), "PRAGMA freelist_count;");
+      // our own steps don't change data_version, writers do
+      while (idle() && worth_it(stats.page_count, stats.freelist_count)
+             && stats.freelist_count > 0 && not stopping()) {
+        if (not step(stats)) break ;
+        std::this_thread::yield();
+      }
+      if (stats.steps > 0 && _report) _report(stats);
+
+      lock.lock();
+      if (stats.steps > 0) _last = stats ;
+    }
+  }
+
+  bool stopping() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stop ;
+  }
+
+  database _db ;
+  vacuum_settings _settings ;
+  report_callback _report ;
+  int _pages_per_step = 64 ;
+  int64_t _data_version = 0 ;
+  std::chrono::steady_clock::time_point _last_activity ;
+
+  mutable std::mutex _mutex ;
+  std::condition_variable _wakeup ;
+  bool _stop = false ;
+  vacuum_stats _last ;
+  std::thread _thread ;
+};
+
+
+void main3()
+{
+  const std::string filename = "vacuum_sample.db" ;
+  remove_database(filename);
+
+  auto db = open_database(filename.c_str());
+  enable_incremental_vacuum(db.get());
+  execute(db.get(), "CREATE TABLE things(id INTEGER PRIMARY KEY, name TEXT,value REAL);");
+  { Transaction transaction(db.get()) ;
+    auto add_thing = create_statement(db.get(),
+          "INSERT INTO things(name, value) VALUES(@name,@value);");
+    for (int i = 0; i < 20000; ++i) {
+      parameter(add_thing.get(), 1, std::string(100, 'x')) ;
+      parameter(add_thing.get(), 2, double(i)) ;
+      run(add_thing.get());
+    }
+    transaction.commit() ;
+  }
+  execute(db.get(), "DELETE FROM things WHERE id % 10 != 0;");
+  std::cout << "pages " << query_int64(db.get(), "PRAGMA page_count;")
+            << ", free " << query_int64(db.get(), "PRAGMA freelist_count;")
+            << "\n" ;
+
+  vacuum_settings settings ;
+  settings.idle = std::chrono::milliseconds(100) ;
+  settings.poll = std::chrono::milliseconds(20) ;
+  auto report = [](const vacuum_stats& s) {
+    std::cout << "incremental vacuum freed " << s.pages_freed << " pages in "
+              << s.steps << " steps, " << s.duration.count() << "us, now "
+              << s.page_count << " pages, " << s.freelist_count << " free\n" ;
+  };
+  incremental_vacuum vacuum(filename, settings, report);
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  vacuum.stop();
+
+  db.reset();
+  remove_database(filename);
+}
+
+
+//
+// chunked bulk DELETE/UPDATE
+//
+// instead of one statement that holds the write lock for minutes, walk the
+// integer key in ranges, one short transaction per range.
+// the chunk size adapts to a target lock time, the cursor is stored in the
+// same transaction as the chunk, so a crashed job continues where it was.
+// chunks take the write lock up front (BEGIN IMMEDIATE). a chunk that
+// fails is rolled back and the cursor stays, busy ones are tried again,
+// other errors stop the job with progress.rc set.
+//
+struct chunked_job
+{
+  std::string name ;      // identifies the persisted cursor
+  std::string table ;
+  std::string key = "id" ; // integer key, walked ascending
+  std::string set ;       // empty for DELETE, else UPDATE table SET <set>
+  std::string where = "1" ;
+};
+
+struct chunked_settings
+{
+  int64_t initial_chunk = 1000 ;
+  int64_t min_chunk = 10 ;
+  int64_t max_chunk = 100000 ;
+  std::chrono::milliseconds target_lock{10} ;
+  std::chrono::milliseconds pause{1} ;  // let others get the lock
+  int retries = 10 ;                     // busy chunks, with a growing pause
+};
+
+struct chunked_progress
+{
+  int64_t cursor = 0 ;    // last key done
+  int64_t rows = 0 ;      // changed rows, including earlier runs
+  int chunks = 0 ;        // chunks of this run
+  int64_t chunk_size = 0 ;
+  bool done = false ;
+  int rc = SQLITE_OK ;    // the error that stopped the job, if any
+};
+
+// aim for the target lock time, but never more than double or half
+int64_t adapt_chunk(int64_t chunk,
+                    std::chrono::steady_clock::duration took,
+                    const chunked_settings& settings)
+{
+  auto target = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      settings.target_lock);
+  auto next = took.count() > 0
+      ? int64_t(double(chunk) * target.count() / took.count())
+      : chunk * 2 ;
+  next = std::max(chunk / 2, std::min(chunk * 2, next));
+  return std::max(settings.min_chunk, std::min(settings.max_chunk, next));
+}
+
+using chunked_callback = std::function<bool(const chunked_progress&)> ;
+
+chunked_progress run_chunked(not_null<sqlite3*> db,
+                             const chunked_job& job,
+                             chunked_settings settings = chunked_settings{},
+                             chunked_callback callback = chunked_callback{})
+{
+  execute(db, "CREATE TABLE IF NOT EXISTS chunked_cursors"
+              "(name TEXT PRIMARY KEY, cursor INTEGER, rows INTEGER);");
+
+  chunked_progress progress ;
+  progress.cursor = std::numeric_limits<int64_t>::min() ;
+  progress.chunk_size = settings.initial_chunk ;
+
+  auto load = create_statement(db,
+        "SELECT cursor, rows FROM chunked_cursors WHERE name = @name;");
+  parameter(load.get(), 1, job.name) ;
+  run(load.get(), [&](not_null<sqlite3_stmt*> row) {
+    progress.cursor = sqlite3_column_int64(row, 0);
+    progress.rows = sqlite3_column_int64(row, 1);
+    return false ;
+  });
+
+  auto next_bound = create_statement(db,
+        "SELECT " + job.key + " FROM " + job.table
+        + " WHERE " + job.key + " > @cursor AND (" + job.where + ")"
+        + " ORDER BY " + job.key + " LIMIT 1 OFFSET @offset;");
+  auto last_key = create_statement(db,
+        "SELECT max(" + job.key + ") FROM " + job.table
+        + " WHERE " + job.key + " > @cursor AND (" + job.where + ");");
+  auto change = create_statement(db,
+        (job.set.empty() ? "DELETE FROM " + job.table
+                         : "UPDATE " + job.table + " SET " + job.set)
+        + " WHERE " + job.key + " > @lo AND " + job.key + " <= @hi"
+        + " AND (" + job.where + ");");
+  auto save = create_statement(db,
+        "INSERT OR REPLACE INTO chunked_cursors VALUES(@name,@cursor,@rows);");
+
+  auto step = [&](sqlite3_stmt* stmt) {
+    int rc ;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) ;
+    sqlite3_reset(stmt);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc ;
+  };
+  // SQLITE_ROW and the key, SQLITE_DONE if there is none, or the error
+  auto fetch_key = [&](sqlite3_stmt* stmt, int64_t& key) {
+    int rc = sqlite3_step(stmt) ;
+    if (rc == SQLITE_ROW && sqlite3_column_type(stmt, 0) == SQLITE_NULL) rc = SQLITE_DONE ;
+    if (rc == SQLITE_ROW) key = sqlite3_column_int64(stmt, 0) ;
+    sqlite3_reset(stmt);
+    return rc ;
+  };
+
+  // one chunk in an own write transaction, nothing of it counts unless
+  // all of it, including the commit, worked.
+  // SQLITE_ROW for a chunk, SQLITE_DONE at the end, or the error
+  auto chunk = [&](int64_t& hi, int64_t& changed) {
+    int rc = sqlite3_exec(db, "BEGIN IMMEDIATE TRANSACTION;", nullptr, nullptr, nullptr);
+    if (rc != SQLITE_OK) return rc ;
+    auto fail = [&](int error) {
+      if (not sqlite3_get_autocommit(db))
+        sqlite3_exec(db, "ROLLBACK TRANSACTION;", nullptr, nullptr, nullptr);
+      return error ;
+    };
+
+    parameter(next_bound.get(), 1, progress.cursor) ;
+    parameter(next_bound.get(), 2, progress.chunk_size - 1) ;
+    rc = fetch_key(next_bound.get(), hi) ;
+    if (rc == SQLITE_DONE) {
+      parameter(last_key.get(), 1, progress.cursor) ;
+      rc = fetch_key(last_key.get(), hi) ;
+    }
+    if (rc == SQLITE_DONE) {
+      auto forget = create_statement(db,
+            "DELETE FROM chunked_cursors WHERE name = @name;");
+      parameter(forget.get(), 1, job.name) ;
+      if ((rc = step(forget.get())) != SQLITE_OK) return fail(rc) ;
+      rc = SQLITE_DONE ;
+    }
+    else if (rc != SQLITE_ROW) return fail(rc) ;
+    else {
+      parameter(change.get(), 1, progress.cursor) ;
+      parameter(change.get(), 2, hi) ;
+      if ((rc = step(change.get())) != SQLITE_OK) return fail(rc) ;
+      changed = sqlite3_changes(db) ;
+
+      parameter(save.get(), 1, job.name) ;
+      parameter(save.get(), 2, hi) ;
+      parameter(save.get(), 3, progress.rows + changed) ;
+      if ((rc = step(save.get())) != SQLITE_OK) return fail(rc) ;
+      rc = SQLITE_ROW ;
+    }
+    int commit = sqlite3_exec(db, "COMMIT TRANSACTION;", nullptr, nullptr, nullptr);
+    return commit == SQLITE_OK ? rc : fail(commit) ;
+  };
+
+  int retries = 0 ;
+  while (true) {
+    auto start = std::chrono::steady_clock::now();
+    int64_t hi = 0, changed = 0 ;
+    int rc = chunk(hi, changed) ;
+    if (rc == SQLITE_DONE) {
+      progress.done = true ;
+      break ;
+    }
+    if (rc != SQLITE_ROW) {
+      // nothing moved, try the same chunk again or give up
+      auto primary = rc & 0xff ;
+      if ((primary == SQLITE_BUSY || primary == SQLITE_LOCKED)
+          && retries < settings.retries) {
+        std::this_thread::sleep_for(settings.pause * ++retries);
+        continue ;
+      }
+      progress.rc = rc ;
+      break ;
+    }
+    retries = 0 ;
+    progress.rows += changed ;
+    progress.cursor = hi ;
+    ++progress.chunks ;
+
+    progress.chunk_size = adapt_chunk(progress.chunk_size,
+        std::chrono::steady_clock::now() - start, settings);
+
+    if (callback && not callback(progress)) break ;
+    std::this_thread::sleep_for(settings.pause);
+  }
+  return progress ;
+}
+
+
+void main4()
+{
+  auto db = open_database(":memory:");
+  execute(db.get(), "CREATE TABLE things(id INTEGER PRIMARY KEY, name TEXT,value REAL);");
+  { Transaction transaction(db.get()) ;
+    auto add_thing = create_statement(db.get(),
+          "INSERT INTO things(name, value) VALUES(@name,@value);");
+    for (int i = 0; i < 100000; ++i) {
+      parameter(add_thing.get(), 1, std::string("thing")) ;
+      parameter(add_thing.get(), 2, double(i % 100)) ;
+      run(add_thing.get());
+    }
+    transaction.commit() ;
+  }
+
+  chunked_job expire ;
+  expire.name = "expire things" ;
+  expire.table = "things" ;
+  expire.where = "value < 50" ;
+
+  // pretend to crash after a few chunks
+  auto crash = [](const chunked_progress& p) { return p.chunks < 3 ; };
+  auto first = run_chunked(db.get(), expire, chunked_settings{}, crash);
+  std::cout << "stopped at id " << first.cursor << " after "
+            << first.rows << " rows\n" ;
+
+  auto second = run_chunked(db.get(), expire);
+  std::cout << "resumed, " << second.rows << " rows deleted in "
+            << second.chunks << " more chunks, last chunk size "
+            << second.chunk_size << ", "
+            << query_int64(db.get(), "SELECT count(*) FROM things;")
+            << " things left\n" ;
+
+  // again on a file, while an other connection keeps writing
+  const std::string name = "chunked.db" ;
+  remove_database(name);
+  { auto file = open_database(name.c_str());
+    execute(file.get(), "PRAGMA journal_mode=WAL;"
+                        "CREATE TABLE things(id INTEGER PRIMARY KEY, name TEXT,value REAL);"
+                        "WITH RECURSIVE n(i) AS (SELECT 0 UNION ALL SELECT i + 1 FROM n"
+                        " WHERE i < 99999) INSERT INTO things(name, value)"
+                        " SELECT 'thing', i % 100 FROM n;");
+    sqlite3_busy_timeout(file.get(), 1);
+
+    std::atomic<bool> stop{false} ;
+    std::thread writer([&]{
+      auto other = open_database(name.c_str());
+      sqlite3_busy_timeout(other.get(), 5000);
+      auto add = create_statement(other.get(),
+            "INSERT INTO things(name, value) VALUES('new', 75);");
+      while (not stop) {
+        Transaction transaction(other.get(), true) ;
+        for (int i = 0; i < 50; ++i) run(add.get());
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        transaction.commit() ;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    });
+    auto contended = run_chunked(file.get(), expire);
+    stop = true ;
+    writer.join();
+    std::cout << "with a writer: done " << std::boolalpha << contended.done
+              << ", rc " << contended.rc << ", " << contended.rows
+              << " rows deleted, " << query_int64(file.get(),
+                  "SELECT count(*) FROM things WHERE value < 50;")
+              << " matching left\n" ;
+  }
+  remove_database(name);
+}
+
+
+//
+// online table rebuild
+//
+// the new table is filled in short chunks while triggers on the old one
+// record the keys of concurrent changes in a delta table.
+// those keys are copied again until only a few are left, or for at most
+// max_rounds if the writers keep up with that, the rest is replayed in
+// the final transaction that also swaps the tables.
+// indexes and triggers of the old table are created again on the new one,
+// from their SQL, so the columns they use have to be in the new table.
+//
+struct rebuild_plan
+{
+  std::string table ;
+  std::string definition ; // of the new table, "(id ..., ...) WITHOUT ROWID"
+  std::string columns ;    // copied columns, same names in both tables
+  std::string key = "id" ; // integer key, unique in both tables
+};
+
+struct rebuild_stats
+{
+  int64_t copied = 0 ;
+  int64_t replayed = 0 ;    // rows copied again because they changed
+  int chunks = 0 ;
+  int replay_rounds = 0 ;
+  std::chrono::microseconds swap_time{0} ;
+};
+
+rebuild_stats rebuild_table(not_null<sqlite3*> db,
+                            const rebuild_plan& plan,
+                            chunked_settings settings = chunked_settings{},
+                            int64_t final_delta = 100,
+                            int max_rounds = 20)
+{
+  const auto& table = plan.table ;
+  const auto& key = plan.key ;
+  const auto target = table + "_rebuild" ;
+  const auto delta = table + "_rebuild_delta" ;
+  const auto trigger = "CREATE TRIGGER " + target ;
+  rebuild_stats stats ;
+
+  { Transaction transaction(db, true) ;
+    execute(db, ("CREATE TABLE " + target + plan.definition + ";").c_str());
+    execute(db, ("CREATE TABLE " + delta
+                 + "(seq INTEGER PRIMARY KEY, key INTEGER);").c_str());
+    execute(db, (trigger + "_insert AFTER INSERT ON " + table
+                 + " BEGIN INSERT INTO " + delta + "(key) VALUES(new." + key
+                 + "); END;").c_str());
+    execute(db, (trigger + "_update AFTER UPDATE ON " + table
+                 + " BEGIN INSERT INTO " + delta + "(key) VALUES(old." + key
+                 + "),(new." + key + "); END;").c_str());
+    execute(db, (trigger + "_delete AFTER DELETE ON " + table
+                 + " BEGIN INSERT INTO " + delta + "(key) VALUES(old." + key
+                 + "); END;").c_str());
+    transaction.commit() ;
+  }
+
+  auto next_bound = create_statement(db,
+        "SELECT " + key + " FROM " + table + " WHERE " + key + " > @cursor"
+        + " ORDER BY " + key + " LIMIT 1 OFFSET @offset;");
+  auto last_key = create_statement(db,
+        "SELECT max(" + key + ") FROM " + table + " WHERE " + key + " > @cursor;");
+  auto copy = create_statement(db,
+        "INSERT OR REPLACE INTO " + target + "(" + plan.columns + ") SELECT "
+        + plan.columns + " FROM " + table + " WHERE " + key + " > @lo AND "
+        + key + " <= @hi;");
+
+  auto cursor = std::numeric_limits<int64_t>::min() ;
+  auto chunk = settings.initial_chunk ;
+  while (true) {
+    auto start = std::chrono::steady_clock::now();
+    Transaction transaction(db, true) ;
+    int64_t hi = 0 ;
+    parameter(next_bound.get(), 1, cursor) ;
+    parameter(next_bound.get(), 2, chunk - 1) ;
+    if (not fetch_int64(next_bound.get(), hi)) {
+      parameter(last_key.get(), 1, cursor) ;
+      if (not fetch_int64(last_key.get(), hi)) break ;
+    }
+    parameter(copy.get(), 1, cursor) ;
+    parameter(copy.get(), 2, hi) ;
+    run(copy.get());
+    stats.copied += sqlite3_changes(db) ;
+    transaction.commit() ;
+    ++stats.chunks ;
+    cursor = hi ;
+    chunk = adapt_chunk(chunk, std::chrono::steady_clock::now() - start,
+                        settings);
+    std::this_thread::sleep_for(settings.pause);
+  }
+
+  auto pending = create_statement(db, "SELECT count(*) FROM " + delta + ";");
+  auto last_seq = create_statement(db, "SELECT max(seq) FROM " + delta + ";");
+  const auto changed = " IN (SELECT key FROM " + delta + " WHERE seq <= @seq);" ;
+  auto forget = create_statement(db,
+        "DELETE FROM " + target + " WHERE " + key + changed);
+  auto recopy = create_statement(db,
+        "INSERT INTO " + target + "(" + plan.columns + ") SELECT "
+        + plan.columns + " FROM " + table + " WHERE " + key + changed);
+  auto done = create_statement(db,
+        "DELETE FROM " + delta + " WHERE seq <= @seq;");
+
+  // the current delta, inside a transaction of the caller
+  auto replay = [&]() {
+    int64_t seq = 0 ;
+    if (not fetch_int64(last_seq.get(), seq)) return ;
+    for (auto stmt : {forget.get(), recopy.get(), done.get()}) {
+      parameter(stmt, 1, seq) ;
+      run(stmt);
+      if (stmt == recopy.get()) stats.replayed += sqlite3_changes(db) ;
+    }
+    ++stats.replay_rounds ;
+  };
+
+  int64_t left = 0 ;
+  while (stats.replay_rounds < max_rounds
+         && fetch_int64(pending.get(), left) && left > final_delta) {
+    Transaction transaction(db, true) ;
+    replay();
+    transaction.commit() ;
+    std::this_thread::sleep_for(settings.pause);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  { Transaction transaction(db, true) ;
+    replay();
+    for (auto what : {"_insert", "_update", "_delete"})
+      execute(db, ("DROP TRIGGER " + target + what + ";").c_str());
+    execute(db, ("DROP TABLE " + delta + ";").c_str());
+    std::vector<std::string> dependents ;
+    auto of_table = create_statement(db, "SELECT sql FROM sqlite_master WHERE"
+          " tbl_name = @table AND type IN ('index', 'trigger') AND sql NOT NULL;");
+    parameter(of_table.get(), 1, table) ;
+    run(of_table.get(), [&](not_null<sqlite3_stmt*> row) {
+      dependents.emplace_back((const char*)sqlite3_column_text(row, 0));
+      return true ;
+    });
+    // views on the table shall survive the moment it does not exist
+    execute(db, "PRAGMA legacy_alter_table=ON;");
+    execute(db, ("DROP TABLE " + table + ";").c_str());
+    execute(db, ("ALTER TABLE " + target + " RENAME TO " + table + ";").c_str());
+    execute(db, "PRAGMA legacy_alter_table=OFF;");
+    for (const auto& sql : dependents) execute(db, (sql + ";").c_str());
+    transaction.commit() ;
+  }
+  stats.swap_time = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  return stats ;
+}
+
+
+void main5()
+{
+  const std::string filename = "rebuild_sample.db" ;
+  remove_database(filename);
+
+  auto db = open_database(filename.c_str());
+  sqlite3_busy_timeout(db.get(), 5000);
+  execute(db.get(), "PRAGMA journal_mode=WAL;");
+  execute(db.get(), "CREATE TABLE things(id INTEGER PRIMARY KEY, name TEXT,value REAL);");
+  const int64_t initial = 20000 ;
+  { Transaction transaction(db.get()) ;
+    auto add_thing = create_statement(db.get(),
+          "INSERT INTO things VALUES(@id,@name,@value);");
+    for (int64_t i = 1; i <= initial; ++i) {
+      parameter(add_thing.get(), 1, i) ;
+      parameter(add_thing.get(), 2, std::string("thing")) ;
+      parameter(add_thing.get(), 3, double(i)) ;
+      run(add_thing.get());
+    }
+    transaction.commit() ;
+  }
+  execute(db.get(), "CREATE INDEX things_value ON things(value);");
+
+  rebuild_plan plan ;
+  plan.table = "things" ;
+  plan.definition = "(id INTEGER PRIMARY KEY, name TEXT NOT NULL DEFAULT '',"
+                    " value REAL, tag TEXT) WITHOUT ROWID" ;
+  plan.columns = "id, name, value" ;
+
+  std::atomic<bool> rebuilding{true} ;
+  rebuild_stats stats ;
+  std::thread rebuilder([&]() {
+    auto own = open_database(filename.c_str());
+    sqlite3_busy_timeout(own.get(), 5000);
+    chunked_settings settings ;
+    settings.initial_chunk = 500 ;
+    settings.max_chunk = 1000 ;
+    stats = rebuild_table(own.get(), plan, settings);
+    rebuilding = false ;
+  });
+
+  // keep writing while the table gets rebuilt
+  auto add_thing = create_statement(db.get(),
+        "INSERT INTO things(id, name, value) VALUES(@id,@name,@value);");
+  auto drop_thing = create_statement(db.get(), "DELETE FROM things WHERE id = @id;");
+  int64_t added = 0, dropped = 0 ;
+  while (rebuilding) {
+    Transaction transaction(db.get(), true) ;
+    parameter(add_thing.get(), 1, initial + added + 1) ;
+    parameter(add_thing.get(), 2, std::string("late")) ;
+    parameter(add_thing.get(), 3, 0.0) ;
+    run(add_thing.get());
+    ++added ;
+    parameter(drop_thing.get(), 1, int64_t{added * 7 % initial}) ;
+    run(drop_thing.get());
+    dropped += sqlite3_changes(db.get()) ;
+    transaction.commit() ;
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  rebuilder.join();
+
+  std::cout << "rebuilt in " << stats.chunks << " chunks, " << stats.copied
+            << " copied, " << stats.replayed << " replayed in "
+            << stats.replay_rounds << " rounds, swap took "
+            << stats.swap_time.count() << "us; "
+            << query_int64(db.get(), "SELECT count(*) FROM things;")
+            << " things, expected " << initial + added - dropped
+            << " after " << added << " concurrent writes, index "
+            << query_int64(db.get(), "SELECT count(*) FROM sqlite_master WHERE"
+                                     " name = 'things_value' AND tbl_name = 'things';")
+            << "\n" ;
+
+  add_thing.reset();
+  drop_thing.reset();
+  db.reset();
+  remove_database(filename);
+}
+
+
+//
+// staged writes
+//
+// writes land in an in-memory database attached as 'stage' and a
+// background thread moves them into the disk tables every interval or
+// once enough rows are pending, all tables in one transaction.
+// staged rows replace disk rows with the same key, <table>_all (a temp
+// view) shows both layers. deletes are not staged, run them on main.
+//
+// the attached database exists only for this connection, so all use of
+// the connection goes through write/read, which serialize with the flush.
+//
+struct staged_settings
+{
+  std::chrono::milliseconds interval{100} ;
+  int64_t max_rows = 10000 ;
+};
+
+class staged_writes
+{
+public:
+  staged_writes(not_null<sqlite3*> db,
+                const std::vector<std::string>& tables,
+                const std::string& key = "id",
+                staged_settings settings = staged_settings{})
+  : _db{db}
+  , _tables(tables)
+  , _settings(settings)
+  {
+    execute(_db, "ATTACH DATABASE ':memory:' AS stage;");
+    for (const auto& t : _tables) {
+      execute(_db, stage_table(t, key).c_str());
+      execute(_db, ("CREATE TEMP VIEW " + t + "_all AS SELECT * FROM main."
+                    + t + " WHERE " + key + " NOT IN (SELECT " + key
+                    + " FROM stage." + t + " WHERE " + key + " NOT NULL)"
+                    + " UNION ALL SELECT * FROM stage." + t + ";").c_str());
+    }
+    _thread = std::thread(&staged_writes::loop, this);
+  }
+
+  ~staged_writes() {
+    stop();
+    for (const auto& t : _tables)
+      execute(_db, ("DROP VIEW temp." + t + "_all;").c_str());
+    execute(_db, "DETACH DATABASE stage;");
+  }
+
+  // f writes into stage.<table>
+  template<typename F>
+  void write(F f) {
+    bool full = false ;
+    { std::lock_guard<std::mutex> lock(_mutex);
+      auto before = sqlite3_total_changes(_db);
+      f(_db);
+      _pending += sqlite3_total_changes(_db) - before ;
+      full = _pending >= _settings.max_rows ;
+    }
+    if (full) _wakeup.notify_one();
+  }
+
+  // f reads, from <table>_all to see staged rows too
+  template<typename F>
+  void read(F f) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    f(_db);
+  }
+
+  // a durability point, the stage is on disk when this returns
+  int64_t flush() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return move_to_disk();
+  }
+
+  void stop() {
+    { std::lock_guard<std::mutex> lock(_mutex);
+      if (_stop) return ;
+      _stop = true ;
+    }
+    _wakeup.notify_one();
+    if (_thread.joinable()) _thread.join();
+    flush();
+  }
+
+  int64_t flushed() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _flushed ;
+  }
+
+  staged_writes (staged_writes&) = delete ;
+  staged_writes& operator=(staged_writes&) = delete ;
+
+private:
+  // the columns of main.<table> with their types, NOT NULL and defaults,
+  // and its primary key, or key if it has none, so that a second staged
+  // write of a key replaces the first
+  std::string stage_table(const std::string& t, const std::string& key) {
+    std::string columns ;
+    std::vector<std::pair<int64_t, std::string>> primary ;
+    auto info = create_statement(_db, "SELECT name, type, \"notnull\", dflt_value, pk"
+                                      " FROM pragma_table_info(@table, 'main');");
+    parameter(info.get(), 1, t) ;
+    run(info.get(), [&](not_null<sqlite3_stmt*> row) {
+      std::string name = (const char*)sqlite3_column_text(row, 0) ;
+      columns += (columns.empty() ? "" : ", ") + name + " "
+               + (const char*)sqlite3_column_text(row, 1) ;
+      if (sqlite3_column_int(row, 2)) columns += " NOT NULL" ;
+      if (sqlite3_column_type(row, 3) != SQLITE_NULL)
+        columns += std::string(" DEFAULT ") + (const char*)sqlite3_column_text(row, 3) ;
+      if (auto pk = sqlite3_column_int64(row, 4)) primary.emplace_back(pk, name);
+      return true ;
+    });
+    if (columns.empty())
+      throw std::invalid_argument("no table main." + t) ;
+    std::sort(primary.begin(), primary.end());
+    std::string keys ;
+    for (const auto& k : primary) keys += (keys.empty() ? "" : ", ") + k.second ;
+    return "CREATE TABLE stage." + t + "(" + columns + ", PRIMARY KEY("
+           + (keys.empty() ? key : keys) + "));" ;
+  }
+
+  int64_t move_to_disk() {
+    if (_pending == 0) return 0 ;
+    int64_t moved = 0 ;
+    Transaction transaction(_db, true) ;
+    for (const auto& t : _tables) {
+      execute(_db, ("INSERT OR REPLACE INTO main." + t
+                    + " SELECT * FROM stage." + t + ";").c_str());
+      moved += sqlite3_changes(_db) ;
+      execute(_db, ("DELETE FROM stage." + t + ";").c_str());
+    }
+    transaction.commit() ;
+    _pending = 0 ;
+    _flushed += moved ;
+    return moved ;
+  }
+
+  void loop() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (not _stop) {
+      _wakeup.wait_for(lock, _settings.interval);
+      if (_stop) break ;
+      move_to_disk();
+    }
+  }
+
+  sqlite3* _db ;
+  std::vector<std::string> _tables ;
+  staged_settings _settings ;
+
+  mutable std::mutex _mutex ;
+  std::condition_variable _wakeup ;
+  bool _stop = false ;
+  int64_t _pending = 0 ;
+  int64_t _flushed = 0 ;
+  std::thread _thread ;
+};
+
+
+void main6()
+{
+  const std::string filename = "staged_sample.db" ;
+  remove_database(filename);
+
+  auto db = open_database(filename.c_str());
+  execute(db.get(), "PRAGMA journal_mode=WAL;");
+  execute(db.get(), "CREATE TABLE things(id INTEGER PRIMARY KEY, name TEXT,value REAL);");
+
+  staged_settings settings ;
+  settings.interval = std::chrono::milliseconds(20) ;
+  settings.max_rows = 1000 ;
+  { staged_writes staged(db.get(), {"things"}, "id", settings);
+
+    auto add_thing = create_statement(db.get(),
+          "INSERT INTO stage.things VALUES(@id,@name,@value);");
+    auto start = std::chrono::steady_clock::now();
+    for (int64_t i = 1; i <= 5000; ++i) {
+      staged.write([&](not_null<sqlite3*>) {
+        parameter(add_thing.get(), 1, i) ;
+        parameter(add_thing.get(), 2, std::string("staged")) ;
+        parameter(add_thing.get(), 3, double(i)) ;
+        run(add_thing.get());
+      });
+    }
+    auto took = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+
+    int64_t visible = 0 ;
+    staged.read([&](not_null<sqlite3*> con) {
+      visible = query_int64(con, "SELECT count(*) FROM things_all;");
+    });
+    std::cout << "5000 staged writes in " << took.count() << "us, "
+              << visible << " visible, " << staged.flushed()
+              << " already on disk\n" ;
+
+    // a second write of a key replaces the staged row
+    staged.write([&](not_null<sqlite3*> con) {
+      execute(con, "INSERT OR REPLACE INTO stage.things VALUES(7, 'again', 7);");
+      execute(con, "INSERT OR REPLACE INTO stage.things VALUES(7, 'last', 7);");
+    });
+    staged.read([&](not_null<sqlite3*> con) {
+      std::cout << query_int64(con, "SELECT count(*) FROM things_all WHERE id = 7;")
+                << " row for key 7\n" ;
+    });
+
+    add_thing.reset();
+    staged.flush();
+    staged.read([&](not_null<sqlite3*> con) {
+      std::cout << query_int64(con, "SELECT count(*) FROM main.things;")
+                << " on disk after flush\n" ;
+    });
+  }
+
+  db.reset();
+  remove_database(filename);
+}
+
+
+//
+// write coalescing for hot keys
+//
+// set/add only touch a sharded hash map, a background thread (or flush)
+// writes one UPDATE per key and flush: the last value, or the sum of the
+// deltas, in batched transactions on an own connection.
+//
+struct coalescing_settings
+{
+  std::chrono::milliseconds interval{100} ;
+  std::size_t max_batch = 10000 ;  // keys per transaction
+};
+
+template<typename Value>
+class coalescing_writer
+{
+public:
+  coalescing_writer(const std::string& filename,
+                    const std::string& table,
+                    const std::string& column,
+                    const std::string& key = "id",
+                    coalescing_settings settings = coalescing_settings{})
+  : _db{open_database(filename.c_str())}
+  , _set{create_statement(_db.get(), "UPDATE " + table + " SET " + column
+                          + " = @value WHERE " + key + " = @key;")}
+  , _add{create_statement(_db.get(), "UPDATE " + table + " SET " + column
+                          + " = " + column + " + @value WHERE " + key
+                          + " = @key;")}
+  , _settings(settings)
+  {
+    sqlite3_busy_timeout(_db.get(), 5000);
+    _thread = std::thread(&coalescing_writer::loop, this);
+  }
+
+  ~coalescing_writer() { stop(); }
+
+  // last value wins
+  void set(int64_t key, Value value) {
+    auto& s = shard(key);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.entries[key] = entry{value, false};
+  }
+
+  // deltas sum up, on top of a pending set too
+  void add(int64_t key, Value delta) {
+    auto& s = shard(key);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.entries.find(key);
+    if (it == s.entries.end()) s.entries.emplace(key, entry{delta, true});
+    else it->second.value += delta ;
+  }
+
+  // a durability point, everything set/added before is on disk after this
+  std::size_t flush() {
+    std::lock_guard<std::mutex> lock(_flush_mutex);
+    std::vector<std::pair<int64_t, entry>> pending ;
+    for (auto& s : _shards) {
+      std::unordered_map<int64_t, entry> taken ;
+      { std::lock_guard<std::mutex> lock(s.mutex);
+        taken.swap(s.entries);
+      }
+      pending.insert(pending.end(), taken.begin(), taken.end());
+    }
+
+    for (std::size_t first = 0; first < pending.size();
+         first += _settings.max_batch) {
+      auto last = std::min(pending.size(), first + _settings.max_batch);
+      Transaction transaction(_db.get(), true) ;
+      for (auto i = first; i < last; ++i) {
+        auto stmt = pending[i].second.delta ? _add.get() : _set.get() ;
+        parameter(stmt, 1, pending[i].second.value) ;
+        parameter(stmt, 2, pending[i].first) ;
+        run(stmt);
+      }
+      transaction.commit() ;
+    }
+    _written += pending.size() ;
+    return pending.size() ;
+  }
+
+  void stop() {
+    { std::lock_guard<std::mutex> lock(_mutex);
+      if (_stop) return ;
+      _stop = true ;
+    }
+    _wakeup.notify_one();
+    if (_thread.joinable()) _thread.join();
+    flush();
+  }
+
+  // UPDATEs executed so far
+  std::size_t written() {
+    std::lock_guard<std::mutex> lock(_flush_mutex);
+    return _written ;
+  }
+
+  coalescing_writer (coalescing_writer&) = delete ;
+  coalescing_writer& operator=(coalescing_writer&) = delete ;
+
+private:
+  struct entry
+  {
+    Value value ;
+    bool delta ;
+  };
+
+  struct shard_type
+  {
+    std::mutex mutex ;
+    std::unordered_map<int64_t, entry> entries ;
+  };
+
+  static constexpr std::size_t shard_count = 16 ;
+
+  shard_type& shard(int64_t key) {
+    return _shards[std::hash<int64_t>{}(key) % shard_count] ;
+  }
+
+  void loop() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (not _stop) {
+      _wakeup.wait_for(lock, _settings.interval);
+      if (_stop) break ;
+      lock.unlock();
+      flush();
+      lock.lock();
+    }
+  }
+
+  database _db ;
+  statement _set ;
+  statement _add ;
+  coalescing_settings _settings ;
+  shard_type _shards[shard_count] ;
+
+  std::mutex _flush_mutex ;
+  std::size_t _written = 0 ;
+
+  std::mutex _mutex ;
+  std::condition_variable _wakeup ;
+  bool _stop = false ;
+  std::thread _thread ;
+};
+
+
+void main7()
+{
+  const std::string filename = "coalescing_sample.db" ;
+  remove_database(filename);
+
+  auto db = open_database(filename.c_str());
+  execute(db.get(), "PRAGMA journal_mode=WAL;");
+  execute(db.get(), "CREATE TABLE things(id INTEGER PRIMARY KEY, name TEXT,value REAL);");
+  execute(db.get(), "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n"
+                    " WHERE i < 1000) INSERT INTO things SELECT i, 'hot', 0 FROM n;");
+
+  const int updates = 200000 ;
+  std::size_t written = 0 ;
+  auto start = std::chrono::steady_clock::now();
+  { coalescing_settings settings ;
+    settings.interval = std::chrono::milliseconds(10) ;
+    coalescing_writer<double> counters(filename, "things", "value", "id", settings);
+    uint32_t random = 42 ;
+    for (int i = 0; i < updates; ++i) {
+      random = random * 1664525u + 1013904223u ;
+      counters.add(random % 1000 + 1, 1.0);
+    }
+    counters.flush();
+    written = counters.written() ;
+  }
+  auto took = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+
+  std::cout << updates << " counter updates coalesced into " << written
+            << " UPDATEs in " << took.count() << "us, sum is "
+            << query_int64(db.get(), "SELECT sum(value) FROM things;") << "\n" ;
+
+  db.reset();
+  remove_database(filename);
+}
+
+
+//
+// bulk update/lookup by key
+//
+// many keys are loaded into a temp table with one prepared insert in one
+// transaction, then a single UPDATE or SELECT ... JOIN does the work.
+// in process a step of a prepared statement is cheap, in main8 the per
+// row path is faster up to 16384 keys and at 100000 the two are within
+// the noise of each other, so there is no size to switch at and the set
+// based path is only taken when asked for.
+// both run in a savepoint, so they can be called in a transaction.
+//
+enum class bulk_path { per_row, set_based } ;
+
+// lookups keep duplicates and order, like one SELECT per key would
+void load_bulk_keys(not_null<sqlite3*> db, const std::vector<int64_t>& keys)
+{
+  execute(db, "CREATE TEMP TABLE IF NOT EXISTS bulk_lookup_keys(bulk_key INTEGER);");
+  auto insert = create_statement(db,
+        "INSERT INTO temp.bulk_lookup_keys VALUES(@key);");
+  for (auto key : keys) {
+    parameter(insert.get(), 1, key) ;
+    run(insert.get());
+  }
+}
+
+template<typename Value>
+void load_bulk_keys(not_null<sqlite3*> db,
+                    const std::vector<std::pair<int64_t, Value>>& rows)
+{
+  execute(db, "CREATE TEMP TABLE IF NOT EXISTS bulk_keys"
+              "(bulk_key INTEGER PRIMARY KEY, bulk_value);");
+  auto insert = create_statement(db,
+        "INSERT OR REPLACE INTO temp.bulk_keys VALUES(@key,@value);");
+  for (const auto& row : rows) {
+    parameter(insert.get(), 1, row.first) ;
+    parameter(insert.get(), 2, row.second) ;
+    run(insert.get());
+  }
+}
+
+// UPDATE table SET column = value WHERE key = key, for all rows
+template<typename Value>
+void bulk_update(not_null<sqlite3*> db,
+                 const std::string& table,
+                 const std::string& column,
+                 const std::string& key,
+                 const std::vector<std::pair<int64_t, Value>>& rows,
+                 bulk_path path = bulk_path::per_row)
+{
+  Savepoint savepoint(db, "bulk_update") ;
+  if (path == bulk_path::per_row) {
+    auto update = create_statement(db, "UPDATE " + table + " SET " + column
+                                   + " = @value WHERE " + key + " = @key;");
+    for (const auto& row : rows) {
+      parameter(update.get(), 1, row.second) ;
+      parameter(update.get(), 2, row.first) ;
+      run(update.get());
+    }
+  }
+  else {
+    load_bulk_keys(db, rows);
+    // UPDATE ... FROM scans the table, this walks the keys instead
+    execute(db, ("UPDATE " + table + " SET " + column + " = (SELECT bulk_value"
+                 " FROM temp.bulk_keys WHERE bulk_key = " + table + "." + key
+                 + ") WHERE " + key + " IN (SELECT bulk_key FROM temp.bulk_keys);"
+                 ).c_str());
+    execute(db, "DELETE FROM temp.bulk_keys;");
+  }
+  savepoint.release() ;
+}
+
+// SELECT columns FROM table WHERE key IN keys, rows in no special order
+void bulk_lookup(not_null<sqlite3*> db,
+                 const std::string& table,
+                 const std::string& columns,
+                 const std::string& key,
+                 const std::vector<int64_t>& keys,
+                 stmt_callback callback,
+                 bulk_path path = bulk_path::per_row)
+{
+  Savepoint savepoint(db, "bulk_lookup") ;
+  if (path == bulk_path::per_row) {
+    auto select = create_statement(db, "SELECT " + columns + " FROM " + table
+                                   + " WHERE " + key + " = @key;");
+    bool more = true ;
+    auto forward = [&](not_null<sqlite3_stmt*> row) {
+      return more = callback(row) ;
+    };
+    for (auto it = keys.begin(); more && it != keys.end(); ++it) {
+      parameter(select.get(), 1, *it) ;
+      run(select.get(), forward);
+    }
+  }
+  else {
+    load_bulk_keys(db, keys);
+    auto select = create_statement(db, "SELECT " + columns + " FROM "
+                                   "temp.bulk_lookup_keys AS b CROSS JOIN " + table
+                                   + " ON " + table + "." + key + " = b.bulk_key"
+                                   " ORDER BY b.rowid;");
+    run(select.get(), callback);
+    execute(db, "DELETE FROM temp.bulk_lookup_keys;");
+  }
+  savepoint.release() ;
+}
+
+
+void main8()
+{
+  auto db = open_database(":memory:");
+  execute(db.get(), "PRAGMA temp_store=MEMORY;");
+  execute(db.get(), "CREATE TABLE things(id INTEGER PRIMARY KEY, name TEXT,value REAL);");
+  execute(db.get(), "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n"
+                    " WHERE i < 200000) INSERT INTO things SELECT i, 'thing', 0 FROM n;");
+
+  std::vector<int64_t> keys ;
+  std::vector<std::pair<int64_t, double>> rows ;
+  uint32_t random = 42 ;
+  for (int i = 0; i < 100000; ++i) {
+    random = random * 1664525u + 1013904223u ;
+    int64_t id = random % 200000 + 1 ;
+    keys.push_back(id);
+    rows.emplace_back(id, double(i));
+  }
+
+  auto measure = [](std::function<void()> f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  };
+  double row_sum = 0, set_sum = 0 ;
+  auto add_to = [](double& sum) {
+    return [&sum](not_null<sqlite3_stmt*> row) {
+      sum += sqlite3_column_double(row, 0);
+      return true ;
+    };
+  };
+  const auto per_row = bulk_path::per_row, set_based = bulk_path::set_based ;
+
+  // where does the set based path start to pay off
+  for (std::size_t n : {16, 64, 256, 1024, 4096, 16384, 100000}) {
+    const std::vector<int64_t> some(keys.begin(), keys.begin() + n) ;
+    const std::vector<std::pair<int64_t, double>> some_rows(rows.begin(), rows.begin() + n) ;
+    const int repeat = int(100000 / n) ;
+    auto repeated = [&](std::function<void()> f) {
+      return measure([&]{ for (int i = 0; i < repeat; ++i) f(); }) / repeat ;
+    };
+    auto row_update = repeated([&]{ bulk_update(db.get(), "things", "value", "id", some_rows, per_row); });
+    auto set_update = repeated([&]{ bulk_update(db.get(), "things", "value", "id", some_rows, set_based); });
+    auto row_lookup = repeated([&]{ bulk_lookup(db.get(), "things", "value", "id", some, add_to(row_sum), per_row); });
+    auto set_lookup = repeated([&]{ bulk_lookup(db.get(), "things", "value", "id", some, add_to(set_sum), set_based); });
+    std::cout << n << " keys, update per row " << row_update
+              << "us, set based " << set_update << "us; lookup per row "
+              << row_lookup << "us, set based " << set_lookup << "us\n" ;
+  }
+  std::cout << "same lookup results " << std::boolalpha << (row_sum == set_sum) << "\n" ;
+
+  // part of the caller's transaction
+  { Transaction transaction(db.get()) ;
+    bulk_update(db.get(), "things", "value", "id", rows, set_based);
+    transaction.commit() ;
+  }
+  std::cout << "in a transaction, value of " << rows.back().first << " is "
+            << query_int64(db.get(), "SELECT value FROM things WHERE id = "
+                                     + std::to_string(rows.back().first) + ";") << "\n" ;
+}
+
+
+//
+// array parameters
+//
+// an in-tree carray: a table valued function over a C++ array that is
+// bound as one pointer parameter, so
+//   SELECT * FROM things WHERE id IN carray(@ids);
+// is one prepared statement for any number of ids.
+// the array itself is not copied, it has to live until the statement is
+// reset or bound to something else.
+//
+struct array_parameter
+{
+  enum element_type { int64, real, text } ;
+  const void* data ;
+  std::size_t size ;
+  element_type type ;
+};
+
+array_parameter as_array(const int64_t* data, std::size_t size)
+{
+  return array_parameter{data, size, array_parameter::int64} ;
+}
+
+array_parameter as_array(const double* data, std::size_t size)
+{
+  return array_parameter{data, size, array_parameter::real} ;
+}
+
+array_parameter as_array(const std::string* data, std::size_t size)
+{
+  return array_parameter{data, size, array_parameter::text} ;
+}
+
+template<typename T>
+array_parameter as_array(const std::vector<T>& values)
+{
+  return as_array(values.data(), values.size());
+}
+
+void parameter(not_null<sqlite3_stmt*> stmt,
+               int index,
+               const array_parameter& values)
+{
+  auto rc = sqlite3_bind_pointer(stmt, index, new array_parameter(values),
+                                 "carray", [](void* p) {
+                                   delete static_cast<array_parameter*>(p);
+                                 });
+  if (rc != SQLITE_OK) throw "TODO" ;
+}
+
+namespace carray_module {
+
+  struct cursor : sqlite3_vtab_cursor
+  {
+    const array_parameter* array = nullptr ;
+    std::size_t index = 0 ;
+  };
+
+  enum column { column_value, column_pointer } ;
+
+  int connect(sqlite3* db, void*, int, const char* const*,
+              sqlite3_vtab** vtab, char**)
+  {
+    auto rc = sqlite3_declare_vtab(db,
+        "CREATE TABLE x(value, pointer HIDDEN);");
+    if (rc != SQLITE_OK) return rc ;
+    *vtab = new sqlite3_vtab{} ;
+    sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+    return SQLITE_OK ;
+  }
+
+  int disconnect(sqlite3_vtab* vtab)
+  {
+    delete vtab ;
+    return SQLITE_OK ;
+  }
+
+  // the pointer argument is required
+  int best_index(sqlite3_vtab*, sqlite3_index_info* info)
+  {
+    for (int i = 0; i < info->nConstraint; ++i) {
+      const auto& c = info->aConstraint[i] ;
+      if (c.iColumn == column_pointer && c.op == SQLITE_INDEX_CONSTRAINT_EQ) {
+        if (not c.usable) return SQLITE_CONSTRAINT ;
+        info->aConstraintUsage[i].argvIndex = 1 ;
+        info->aConstraintUsage[i].omit = 1 ;
+        info->idxNum = 1 ;
+        info->estimatedCost = 1 ;
+        info->estimatedRows = 100 ;
+        return SQLITE_OK ;
+      }
+    }
+    return SQLITE_CONSTRAINT ;
+  }
+
+  int open(sqlite3_vtab*, sqlite3_vtab_cursor** cur)
+  {
+    *cur = new cursor{} ;
+    return SQLITE_OK ;
+  }
+
+  int close(sqlite3_vtab_cursor* cur)
+  {
+    delete static_cast<cursor*>(cur) ;
+    return SQLITE_OK ;
+  }
+
+  int filter(sqlite3_vtab_cursor* base, int, const char*,
+             int argc, sqlite3_value** argv)
+  {
+    auto cur = static_cast<cursor*>(base) ;
+    cur->array = argc > 0 ? static_cast<const array_parameter*>(
+        sqlite3_value_pointer(argv[0], "carray")) : nullptr ;
+    cur->index = 0 ;
+    return SQLITE_OK ;
+  }
+
+  int next(sqlite3_vtab_cursor* base)
+  {
+    ++static_cast<cursor*>(base)->index ;
+    return SQLITE_OK ;
+  }
+
+  int eof(sqlite3_vtab_cursor* base)
+  {
+    auto cur = static_cast<cursor*>(base) ;
+    return cur->array == nullptr || cur->index >= cur->array->size ;
+  }
+
+  int column(sqlite3_vtab_cursor* base, sqlite3_context* ctx, int col)
+  {
+    auto cur = static_cast<cursor*>(base) ;
+    if (col != column_value) return SQLITE_OK ;
+    const auto& a = *cur->array ;
+    switch (a.type) {
+      case array_parameter::int64:
+        sqlite3_result_int64(ctx, static_cast<const int64_t*>(a.data)[cur->index]);
+        break ;
+      case array_parameter::real:
+        sqlite3_result_double(ctx, static_cast<const double*>(a.data)[cur->index]);
+        break ;
+      case array_parameter::text: {
+        const auto& s = static_cast<const std::string*>(a.data)[cur->index] ;
+        sqlite3_result_text(ctx, s.data(), s.size(), SQLITE_STATIC);
+        break ;
+      }
+    }
+    return SQLITE_OK ;
+  }
+
+  int rowid(sqlite3_vtab_cursor* base, sqlite3_int64* id)
+  {
+    *id = static_cast<cursor*>(base)->index + 1 ;
+    return SQLITE_OK ;
+  }
+
+  // eponymous only, there is no CREATE VIRTUAL TABLE ... USING carray
+  sqlite3_module module = {
+    0, nullptr, connect, best_index, disconnect, nullptr,
+    open, close, filter, next, eof, column, rowid,
+    nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+    nullptr, nullptr, nullptr, nullptr
+  };
+}
+
+void register_carray(not_null<sqlite3*> db)
+{
+  auto rc = sqlite3_create_module(db, "carray", &carray_module::module, nullptr);
+  if (rc != SQLITE_OK) {
+    std::cerr << "Unable to register carray: " << sqlite3_errmsg(db);
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+
+void main9()
+{
+  auto db = open_database(":memory:");
+  register_carray(db.get());
+  execute(db.get(), "CREATE TABLE things(id INTEGER PRIMARY KEY, name TEXT,value REAL);");
+  execute(db.get(), "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n"
+                    " WHERE i < 1000) INSERT INTO things SELECT i, 'thing' || i, i FROM n;");
+
+  auto by_ids = create_statement(db.get(),
+        "SELECT count(*), sum(value) FROM things WHERE id IN carray(@ids);");
+  auto by_names = create_statement(db.get(),
+        "SELECT count(*), sum(value) FROM things WHERE name IN carray(@names);");
+  auto print = [](not_null<sqlite3_stmt*> row) {
+    std::cout << "  " << sqlite3_column_int64(row, 0) << " things, value "
+              << sqlite3_column_double(row, 1) << "\n" ;
+    return false ;
+  };
+
+  std::vector<int64_t> few = {1, 2, 3} ;
+  std::vector<int64_t> many ;
+  for (int64_t i = 1; i <= 1000; i += 10) many.push_back(i);
+  std::vector<std::string> names = {"thing7", "thing70", "no thing"} ;
+
+  std::cout << "one statement, any list length\n" ;
+  parameter(by_ids.get(), 1, as_array(few)) ;
+  run(by_ids.get(), print);
+  parameter(by_ids.get(), 1, as_array(many)) ;
+  run(by_ids.get(), print);
+  parameter(by_names.get(), 1, as_array(names)) ;
+  run(by_names.get(), print);
+}
+
+
+//
+// C++ containers as read only tables
+//
+// a contiguous container of structs, sorted by an int64 key, becomes an
+// eponymous virtual table that can be joined against real tables without
+// inserting anything. key equality and ranges are binary searches, an
+// ORDER BY key is free. the container has to outlive the connection.
+//
+template<typename Row>
+struct container_column
+{
+  std::string name ;
+  const char* type ;
+  std::function<void(sqlite3_context*, const Row&)> result ;
+  int64_t Row::* key ;  // set for int64 members, the first column needs it
+};
+
+inline void result(sqlite3_context* ctx, int64_t v) { sqlite3_result_int64(ctx, v); }
+inline void result(sqlite3_context* ctx, int v) { sqlite3_result_int(ctx, v); }
+inline void result(sqlite3_context* ctx, double v) { sqlite3_result_double(ctx, v); }
+inline void result(sqlite3_context* ctx, const std::string& v) {
+  sqlite3_result_text(ctx, v.data(), v.size(), SQLITE_STATIC);
+}
+
+constexpr const char* declared_type(int64_t*) { return "INTEGER" ; }
+constexpr const char* declared_type(int*) { return "INTEGER" ; }
+constexpr const char* declared_type(double*) { return "REAL" ; }
+constexpr const char* declared_type(std::string*) { return "TEXT" ; }
+
+template<typename Row, typename T>
+int64_t Row::* key_member(T Row::*) { return nullptr ; }
+
+template<typename Row>
+int64_t Row::* key_member(int64_t Row::* member) { return member ; }
+
+template<typename Row, typename T>
+container_column<Row> member_column(const std::string& name, T Row::* member)
+{
+  return container_column<Row>{
+    name, declared_type(static_cast<T*>(nullptr)),
+    [member](sqlite3_context* ctx, const Row& row) { result(ctx, row.*member); },
+    key_member(member)
+  };
+}
+
+template<typename Container>
+struct container_module
+{
+  using row_type = typename Container::value_type ;
+
+  struct description
+  {
+    const Container* rows ;
+    std::vector<container_column<row_type>> columns ;
+  };
+
+  struct table : sqlite3_vtab
+  {
+    const description* d ;
+  };
+
+  struct cursor : sqlite3_vtab_cursor
+  {
+    std::size_t pos = 0 ;
+    std::size_t end = 0 ;
+  };
+
+  // idxNum bits, which key constraints come as arguments, in that order
+  enum { eq = 1, gt = 2, ge = 4, lt = 8, le = 16 } ;
+
+  static int connect(sqlite3* db, void* p, int, const char* const*,
+                     sqlite3_vtab** vtab, char**)
+  {
+    std::string ddl = "CREATE TABLE x(" ;
+    auto d = static_cast<const description*>(p) ;
+    for (const auto& c : d->columns)
+      ddl += c.name + " " + c.type + "," ;
+    ddl.back() = ')' ;
+    auto rc = sqlite3_declare_vtab(db, ddl.c_str());
+    if (rc != SQLITE_OK) return rc ;
+    sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+    auto t = new table{} ;
+    t->d = d ;
+    *vtab = t ;
+    return SQLITE_OK ;
+  }
+
+  static int disconnect(sqlite3_vtab* vtab)
+  {
+    delete static_cast<table*>(vtab) ;
+    return SQLITE_OK ;
+  }
+
+  static int best_index(sqlite3_vtab* vtab, sqlite3_index_info* info)
+  {
+    int flags = 0, argc = 0 ;
+    for (int bit : {eq, gt, ge, lt, le}) {
+      for (int i = 0; i < info->nConstraint; ++i) {
+        const auto& c = info->aConstraint[i] ;
+        if (not c.usable || c.iColumn != 0) continue ;
+        int op = c.op == SQLITE_INDEX_CONSTRAINT_EQ ? eq
+               : c.op == SQLITE_INDEX_CONSTRAINT_GT ? gt
+               : c.op == SQLITE_INDEX_CONSTRAINT_GE ? ge
+               : c.op == SQLITE_INDEX_CONSTRAINT_LT ? lt
+               : c.op == SQLITE_INDEX_CONSTRAINT_LE ? le : 0 ;
+        if (op != bit || (flags & bit)) continue ;
+        flags |= bit ;
+        info->aConstraintUsage[i].argvIndex = ++argc ;
+      }
+    }
+    info->idxNum = flags ;
+    double rows = static_cast<table*>(vtab)->d->rows->size() + 1 ;
+    if (flags & eq) {
+      info->estimatedCost = std::log2(rows) ;
+      info->estimatedRows = 1 ;
+    }
+    else if (flags) {
+      info->estimatedCost = std::log2(rows) + rows / 4 ;
+      info->estimatedRows = int64_t(rows / 4) ;
+    }
+    else {
+      info->estimatedCost = rows ;
+      info->estimatedRows = int64_t(rows) ;
+    }
+    if (info->nOrderBy == 1 && info->aOrderBy[0].iColumn == 0
+        && not info->aOrderBy[0].desc)
+      info->orderByConsumed = 1 ;
+    return SQLITE_OK ;
+  }
+
+  static int open(sqlite3_vtab*, sqlite3_vtab_cursor** cur)
+  {
+    *cur = new cursor{} ;
+    return SQLITE_OK ;
+  }
+
+  static int close(sqlite3_vtab_cursor* cur)
+  {
+    delete static_cast<cursor*>(cur) ;
+    return SQLITE_OK ;
+  }
+
+  // a REAL bound as key, clamped, converting a double out of the int64_t
+  // range is undefined
+  static int64_t key_bound(double d)
+  {
+    if (not (d > -9223372036854775808.0)) return std::numeric_limits<int64_t>::min() ;
+    if (d >= 9223372036854775808.0) return std::numeric_limits<int64_t>::max() ;
+    return int64_t(d) ;
+  }
+
+  // the first row not before / the first row after the bound, a REAL
+  // bound is rounded outwards, SQLite checks the constraints again anyway
+  static std::size_t lower(const description* t, sqlite3_value* v, bool after)
+  {
+    auto key = t->columns.front().key ;
+    auto first = t->rows->data(), last = first + t->rows->size() ;
+    auto type = sqlite3_value_numeric_type(v);
+    if (type != SQLITE_INTEGER && type != SQLITE_FLOAT) return 0 ;
+    int64_t bound = type == SQLITE_INTEGER ? sqlite3_value_int64(v)
+                  : key_bound(std::floor(sqlite3_value_double(v))) ;
+    auto pos = after
+      ? std::upper_bound(first, last, bound,
+            [key](int64_t b, const row_type& r) { return b < r.*key; })
+      : std::lower_bound(first, last, bound,
+            [key](const row_type& r, int64_t b) { return r.*key < b; });
+    return pos - first ;
+  }
+
+  static std::size_t upper(const description* t, sqlite3_value* v, bool inclusive)
+  {
+    auto type = sqlite3_value_numeric_type(v);
+    if (type != SQLITE_INTEGER && type != SQLITE_FLOAT) return t->rows->size() ;
+    if (type == SQLITE_FLOAT) inclusive = true ;
+    auto key = t->columns.front().key ;
+    auto first = t->rows->data(), last = first + t->rows->size() ;
+    int64_t bound = type == SQLITE_INTEGER ? sqlite3_value_int64(v)
+                  : key_bound(std::ceil(sqlite3_value_double(v))) ;
+    auto pos = inclusive
+      ? std::upper_bound(first, last, bound,
+            [key](int64_t b, const row_type& r) { return b < r.*key; })
+      : std::lower_bound(first, last, bound,
+            [key](const row_type& r, int64_t b) { return r.*key < b; });
+    return pos - first ;
+  }
+
+  static int filter(sqlite3_vtab_cursor* base, int flags, const char*,
+                    int, sqlite3_value** argv)
+  {
+    auto cur = static_cast<cursor*>(base) ;
+    auto t = static_cast<const table*>(base->pVtab)->d ;
+    cur->pos = 0 ;
+    cur->end = t->rows->size() ;
+    int arg = 0 ;
+    if (flags & eq) {
+      cur->pos = std::max(cur->pos, lower(t, argv[arg], false));
+      cur->end = std::min(cur->end, upper(t, argv[arg++], true));
+    }
+    if (flags & gt) cur->pos = std::max(cur->pos, lower(t, argv[arg++], true));
+    if (flags & ge) cur->pos = std::max(cur->pos, lower(t, argv[arg++], false));
+    if (flags & lt) cur->end = std::min(cur->end, upper(t, argv[arg++], false));
+    if (flags & le) cur->end = std::min(cur->end, upper(t, argv[arg++], true));
+    return SQLITE_OK ;
+  }
+
+  static int next(sqlite3_vtab_cursor* base)
+  {
+    ++static_cast<cursor*>(base)->pos ;
+    return SQLITE_OK ;
+  }
+
+  static int eof(sqlite3_vtab_cursor* base)
+  {
+    auto cur = static_cast<cursor*>(base) ;
+    return cur->pos >= cur->end ;
+  }
+
+  static int column(sqlite3_vtab_cursor* base, sqlite3_context* ctx, int col)
+  {
+    auto cur = static_cast<cursor*>(base) ;
+    auto t = static_cast<const table*>(base->pVtab)->d ;
+    t->columns[col].result(ctx, t->rows->data()[cur->pos]);
+    return SQLITE_OK ;
+  }
+
+  static int rowid(sqlite3_vtab_cursor* base, sqlite3_int64* id)
+  {
+    *id = static_cast<cursor*>(base)->pos ;
+    return SQLITE_OK ;
+  }
+
+  static sqlite3_module module ;
+};
+
+template<typename Container>
+sqlite3_module container_module<Container>::module = {
+  0, nullptr, connect, best_index, disconnect, nullptr,
+  open, close, filter, next, eof, column, rowid,
+  nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+  nullptr, nullptr, nullptr, nullptr
+};
+
+template<typename Container>
+void register_container(
+    not_null<sqlite3*> db,
+    const std::string& name,
+    const Container& rows,
+    std::vector<container_column<typename Container::value_type>> columns)
+{
+  using module = container_module<Container> ;
+  auto key = columns.empty() ? nullptr : columns.front().key ;
+  auto sorted = key && std::is_sorted(rows.data(), rows.data() + rows.size(),
+      [key](const typename module::row_type& a,
+            const typename module::row_type& b) { return a.*key < b.*key; });
+  if (not sorted) {
+    std::cerr << "Unable to register '" << name
+              << "': the first column must be an int64 key, rows sorted by it";
+    std::exit(EXIT_FAILURE);
+  }
+
+  auto d = new typename module::description{&rows, std::move(columns)} ;
+  auto rc = sqlite3_create_module_v2(db, name.c_str(), &module::module, d,
+      [](void* p) { delete static_cast<typename module::description*>(p); });
+  if (rc != SQLITE_OK) {
+    std::cerr << "Unable to register '" << name << "': " << sqlite3_errmsg(db);
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+
+struct thing
+{
+  int64_t id ;
+  std::string name ;
+  double value ;
+};
+
+void main10()
+{
+  auto db = open_database(":memory:");
+  execute(db.get(), "CREATE TABLE things(id INTEGER PRIMARY KEY, name TEXT,value REAL);");
+  execute(db.get(), "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n"
+                    " WHERE i < 1000) INSERT INTO things SELECT i, 'thing', i FROM n;");
+
+  std::vector<thing> memory ;
+  for (int64_t i = 1; i <= 100000; i += 3)
+    memory.push_back(thing{i, "memory" + std::to_string(i), i * 0.5});
+
+  register_container(db.get(), "memory_things", memory, {
+    member_column("id", &thing::id),
+    member_column("name", &thing::name),
+    member_column("value", &thing::value)
+  });
+
+  auto joined = create_statement(db.get(),
+        "SELECT count(*), sum(m.value) FROM things t"
+        " JOIN memory_things m ON m.id = t.id WHERE t.value > 500;");
+  run(joined.get(), [](not_null<sqlite3_stmt*> row) {
+    std::cout << "joined " << sqlite3_column_int64(row, 0) << " in memory things, "
+              << "value " << sqlite3_column_double(row, 1) << "\n" ;
+    return false ;
+  });
+  auto range = create_statement(db.get(),
+        "SELECT * FROM memory_things WHERE id > 10 AND id <= 22.5 ORDER BY id;");
+  run(range.get(), dump_current_row);
+  // bounds beyond the int64_t range
+  std::cout << "id < 1e300: "
+            << query_int64(db.get(), "SELECT count(*) FROM memory_things WHERE id < 1e300;")
+            << ", id <= 9.3e18: "
+            << query_int64(db.get(), "SELECT count(*) FROM memory_things WHERE id <= 9.3e18;")
+            << ", id > -1e300: "
+            << query_int64(db.get(), "SELECT count(*) FROM memory_things WHERE id > -1e300;")
+            << ", id > 1e300: "
+            << query_int64(db.get(), "SELECT count(*) FROM memory_things WHERE id > 1e300;")
+            << " of " << memory.size() << "\n" ;
+}
+
+
+//
+// C++ callables as SQL functions
+//
+// register_function deduces the SQL arguments from the callable's
+// parameters and the result from its return type, the decoding is
+// resolved at compile time. a first parameter of type sqlite3_context*
+// gets the context, for cached(), and is not an SQL argument.
+// a NULL argument gives NULL without calling the function.
+// functions are DETERMINISTIC and INNOCUOUS, they can be used in indexes
+// on expressions, so they must not have side effects.
+//
+
+// text without a copy, valid while the value or column it comes from is
+struct text_view
+{
+  const char* data ;
+  std::size_t size ;
+
+  std::string str() const { return std::string(data, size) ; }
+};
+
+template<std::size_t... I> struct indices {} ;
+template<std::size_t N, std::size_t... I>
+struct make_indices : make_indices<N - 1, N - 1, I...> {} ;
+template<std::size_t... I>
+struct make_indices<0, I...> { using type = indices<I...> ; } ;
+
+template<typename F>
+struct callable_traits : callable_traits<decltype(&F::operator())> {} ;
+
+template<typename R, typename... A>
+struct callable_traits<R (*)(A...)>
+{
+  using result_type = R ;
+  using arguments = std::tuple<A...> ;
+};
+
+template<typename C, typename R, typename... A>
+struct callable_traits<R (C::*)(A...)> : callable_traits<R (*)(A...)> {} ;
+
+template<typename C, typename R, typename... A>
+struct callable_traits<R (C::*)(A...) const> : callable_traits<R (*)(A...)> {} ;
+
+template<typename T> struct sql_arg ;
+
+template<> struct sql_arg<int64_t> {
+  static int64_t get(sqlite3_value* v) { return sqlite3_value_int64(v); }
+};
+template<> struct sql_arg<int> {
+  static int get(sqlite3_value* v) { return sqlite3_value_int(v); }
+};
+template<> struct sql_arg<double> {
+  static double get(sqlite3_value* v) { return sqlite3_value_double(v); }
+};
+template<> struct sql_arg<text_view> {
+  static text_view get(sqlite3_value* v) {
+    auto first = reinterpret_cast<const char*>(sqlite3_value_text(v));
+    return text_view{first, std::size_t(sqlite3_value_bytes(v))} ;
+  }
+};
+template<> struct sql_arg<std::string> {
+  static std::string get(sqlite3_value* v) { return sql_arg<text_view>::get(v).str(); }
+};
+
+inline void return_value(sqlite3_context* ctx, int64_t v) { sqlite3_result_int64(ctx, v); }
+inline void return_value(sqlite3_context* ctx, int v) { sqlite3_result_int(ctx, v); }
+inline void return_value(sqlite3_context* ctx, bool v) { sqlite3_result_int(ctx, v); }
+inline void return_value(sqlite3_context* ctx, double v) { sqlite3_result_double(ctx, v); }
+inline void return_value(sqlite3_context* ctx, const std::string& v) {
+  sqlite3_result_text(ctx, v.data(), v.size(), SQLITE_TRANSIENT);
+}
+
+// per statement cache for something made from constant argument arg
+template<typename T, typename Make>
+T& cached(sqlite3_context* ctx, int arg, Make make)
+{
+  if (auto p = sqlite3_get_auxdata(ctx, arg)) return *static_cast<T*>(p);
+  auto p = new T(make());
+  sqlite3_set_auxdata(ctx, arg, p, [](void* d) { delete static_cast<T*>(d); });
+  // SQLite drops it right away if it can not keep it
+  if (sqlite3_get_auxdata(ctx, arg) != p) throw std::bad_alloc{} ;
+  return *p ;
+}
+
+template<typename F, typename... A>
+struct function_adapter
+{
+  static const int arity = sizeof...(A) ;
+
+  template<std::size_t... I>
+  static void invoke(sqlite3_context* ctx, F& f, sqlite3_value** argv, indices<I...>) {
+    return_value(ctx, f(sql_arg<typename std::decay<A>::type>::get(argv[I])...));
+  }
+
+  static void call(sqlite3_context* ctx, F& f, sqlite3_value** argv) {
+    invoke(ctx, f, argv, typename make_indices<sizeof...(A)>::type{});
+  }
+};
+
+template<typename F, typename... A>
+struct function_adapter<F, sqlite3_context*, A...>
+{
+  static const int arity = sizeof...(A) ;
+
+  template<std::size_t... I>
+  static void invoke(sqlite3_context* ctx, F& f, sqlite3_value** argv, indices<I...>) {
+    return_value(ctx, f(ctx, sql_arg<typename std::decay<A>::type>::get(argv[I])...));
+  }
+
+  static void call(sqlite3_context* ctx, F& f, sqlite3_value** argv) {
+    invoke(ctx, f, argv, typename make_indices<sizeof...(A)>::type{});
+  }
+};
+
+template<typename F, typename Arguments> struct function_adapter_for ;
+template<typename F, typename... A>
+struct function_adapter_for<F, std::tuple<A...>>
+{
+  using type = function_adapter<F, A...> ;
+};
+
+template<typename F>
+void scalar_function(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+{
+  using adapter = typename function_adapter_for<
+      F, typename callable_traits<F>::arguments>::type ;
+  for (int i = 0; i < argc; ++i) {
+    if (sqlite3_value_type(argv[i]) == SQLITE_NULL) {
+      sqlite3_result_null(ctx);
+      return ;
+    }
+  }
+  try {
+    adapter::call(ctx, *static_cast<F*>(sqlite3_user_data(ctx)), argv);
+  }
+  catch (const std::bad_alloc&) {
+    sqlite3_result_error_nomem(ctx);
+  }
+  catch (const std::exception& e) {
+    sqlite3_result_error(ctx, e.what(), -1);
+  }
+}
+
+template<typename F>
+void register_function(not_null<sqlite3*> db, const std::string& name, F f)
+{
+  using adapter = typename function_adapter_for<
+      F, typename callable_traits<F>::arguments>::type ;
+  auto rc = sqlite3_create_function_v2(db, name.c_str(), adapter::arity,
+      SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS,
+      new F(std::move(f)), &scalar_function<F>, nullptr, nullptr,
+      [](void* p) { delete static_cast<F*>(p); });
+  if (rc != SQLITE_OK) {
+    std::cerr << "Unable to register function '" << name << "': "
+              << sqlite3_errmsg(db);
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+
+bool dump_query_plan(not_null<sqlite3_stmt*> stmt)
+{
+  std::cout << "  " << sqlite3_column_text(stmt, 3) << "\n" ;
+  return true ;
+}
+
+void main11()
+{
+  auto db = open_database(":memory:");
+  execute(db.get(), "CREATE TABLE things(id INTEGER PRIMARY KEY, name TEXT,value REAL);");
+  execute(db.get(), "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n"
+                    " WHERE i < 10000) INSERT INTO things"
+                    " SELECT i, 'thing' || i, i * 1.5 FROM n;");
+
+  register_function(db.get(), "bucket", [](double value, int64_t width) {
+    return int64_t(std::floor(value / width));
+  });
+  // counts bytes of text that are in set, the lookup table is made once
+  // per statement
+  register_function(db.get(), "count_of",
+      [](sqlite3_context* ctx, text_view set, text_view text) {
+    auto& table = cached<std::vector<bool>>(ctx, 0, [&]() {
+      std::vector<bool> t(256) ;
+      for (std::size_t i = 0; i < set.size; ++i) t[uint8_t(set.data[i])] = true ;
+      return t ;
+    });
+    int64_t n = 0 ;
+    for (std::size_t i = 0; i < text.size; ++i) n += table[uint8_t(text.data[i])] ;
+    return n ;
+  });
+
+  execute(db.get(), "CREATE INDEX things_bucket ON things(bucket(value, 100));");
+  const std::string query = "SELECT count(*), sum(count_of('0123456789', name))"
+                            " FROM things WHERE bucket(value, 100) = 42;" ;
+  auto plan = create_statement(db.get(), "EXPLAIN QUERY PLAN " + query);
+  run(plan.get(), dump_query_plan);
+  auto stmt = create_statement(db.get(), query);
+  run(stmt.get(), dump_current_row);
+}
+
+
+//
+// C++ aggregate functions
+//
+// register_aggregate<State> takes the SQL arguments from the parameters
+// of State::step and the result from State::value. a State with an
+// inverse member is registered as window function too.
+// rows with a NULL argument are skipped, like sum() does.
+//
+template<> struct sql_arg<sqlite3_value*> {
+  static sqlite3_value* get(sqlite3_value* v) { return v; }
+};
+
+template<typename State, typename... A, std::size_t... I>
+void call_member(State& s, void (State::*m)(A...), sqlite3_value** argv,
+                 indices<I...>)
+{
+  (s.*m)(sql_arg<typename std::decay<A>::type>::get(argv[I])...);
+}
+
+template<typename State, typename... A>
+void call_member(State& s, void (State::*m)(A...), sqlite3_value** argv)
+{
+  call_member(s, m, argv, typename make_indices<sizeof...(A)>::type{});
+}
+
+template<typename State, typename... A>
+constexpr int member_arity(void (State::*)(A...)) { return sizeof...(A) ; }
+
+template<typename T>
+struct has_inverse
+{
+  template<typename U> static std::true_type test(decltype(&U::inverse)) ;
+  template<typename U> static std::false_type test(...) ;
+  static const bool value = decltype(test<T>(nullptr))::value ;
+};
+
+template<typename State>
+struct aggregate_adapter
+{
+  // the aggregate context holds a pointer, State need not be trivial
+  static State* state(sqlite3_context* ctx, bool create) {
+    auto slot = static_cast<State**>(
+        sqlite3_aggregate_context(ctx, create ? sizeof(State*) : 0));
+    if (slot == nullptr) {
+      if (create) throw std::bad_alloc{} ;
+      return nullptr ;
+    }
+    if (*slot == nullptr && create) *slot = new State() ;
+    return *slot ;
+  }
+
+  template<typename Member>
+  static void apply(sqlite3_context* ctx, int argc, sqlite3_value** argv,
+                    Member member) {
+    for (int i = 0; i < argc; ++i)
+      if (sqlite3_value_type(argv[i]) == SQLITE_NULL) return ;
+    try {
+      call_member(*state(ctx, true), member, argv);
+    }
+    catch (const std::bad_alloc&) {
+      sqlite3_result_error_nomem(ctx);
+    }
+    catch (const std::exception& e) {
+      sqlite3_result_error(ctx, e.what(), -1);
+    }
+  }
+
+  static void step(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+    apply(ctx, argc, argv, &State::step);
+  }
+
+  template<typename S = State>
+  static void inverse(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+    apply(ctx, argc, argv, &S::inverse);
+  }
+
+  static void value(sqlite3_context* ctx) {
+    try {
+      auto s = state(ctx, false);
+      return_value(ctx, s ? s->value() : State().value());
+    }
+    catch (const std::bad_alloc&) {
+      sqlite3_result_error_nomem(ctx);
+    }
+    catch (const std::exception& e) {
+      sqlite3_result_error(ctx, e.what(), -1);
+    }
+  }
+
+  static void final(sqlite3_context* ctx) {
+    value(ctx);
+    auto slot = static_cast<State**>(sqlite3_aggregate_context(ctx, 0));
+    if (slot) {
+      delete *slot ;
+      *slot = nullptr ;
+    }
+  }
+};
+
+template<typename State>
+int create_aggregate(not_null<sqlite3*> db, const std::string& name,
+                     int arity, int flags, std::false_type)
+{
+  using adapter = aggregate_adapter<State> ;
+  return sqlite3_create_function_v2(db, name.c_str(), arity, flags, nullptr,
+      nullptr, &adapter::step, &adapter::final, nullptr);
+}
+
+template<typename State>
+int create_aggregate(not_null<sqlite3*> db, const std::string& name,
+                     int arity, int flags, std::true_type)
+{
+  using adapter = aggregate_adapter<State> ;
+  return sqlite3_create_window_function(db, name.c_str(), arity, flags,
+      nullptr, &adapter::step, &adapter::final, &adapter::value,
+      &adapter::template inverse<State>, nullptr);
+}
+
+template<typename State>
+void register_aggregate(not_null<sqlite3*> db, const std::string& name)
+{
+  auto rc = create_aggregate<State>(db, name, member_arity(&State::step),
+      SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS,
+      std::integral_constant<bool, has_inverse<State>::value>{});
+  if (rc != SQLITE_OK) {
+    std::cerr << "Unable to register aggregate '" << name << "': "
+              << sqlite3_errmsg(db);
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+
+// percentile(Y, P), P in 0..100, exact, interpolated between ranks
+struct percentile_aggregate
+{
+  std::vector<double> values ;
+  double p = 50 ;
+
+  void step(double v, double percent) {
+    if (percent < 0 || percent > 100)
+      throw std::domain_error("percentile must be between 0 and 100") ;
+    values.push_back(v);
+    p = percent ;
+  }
+
+  void inverse(double v, double) {
+    auto it = std::find(values.begin(), values.end(), v);
+    if (it == values.end()) return ;
+    *it = values.back() ;
+    values.pop_back();
+  }
+
+  // NaN is NULL for SQLite
+  double value() const {
+    if (values.empty()) return std::numeric_limits<double>::quiet_NaN() ;
+    auto copy = values ;
+    auto rank = p / 100 * (copy.size() - 1) ;
+    auto k = std::size_t(rank) ;
+    std::nth_element(copy.begin(), copy.begin() + k, copy.end());
+    auto lower = copy[k] ;
+    if (k + 1 >= copy.size()) return lower ;
+    auto upper = *std::min_element(copy.begin() + k + 1, copy.end());
+    return lower + (upper - lower) * (rank - k) ;
+  }
+};
+
+// merging t-digest, approximate quantiles in bounded memory
+class tdigest
+{
+public:
+  explicit tdigest(double compression = 100) : _compression(compression) {}
+
+  void add(double x, double weight = 1) {
+    _buffer.push_back(centroid{x, weight});
+    _min = std::min(_min, x);
+    _max = std::max(_max, x);
+    if (_buffer.size() >= 5 * std::size_t(_compression)) compress();
+  }
+
+  double quantile(double q) {
+    compress();
+    if (_centroids.empty()) return std::numeric_limits<double>::quiet_NaN() ;
+    if (_centroids.size() == 1) return _centroids.front().mean ;
+    auto target = q * _total ;
+    // interpolate between centroid centers, min and max at the ends
+    double cumulative = 0 ;
+    double prev_center = 0, prev_mean = _min ;
+    for (const auto& c : _centroids) {
+      auto center = cumulative + c.weight / 2 ;
+      if (target < center) {
+        auto t = center > prev_center ? (target - prev_center) / (center - prev_center) : 0 ;
+        return prev_mean + t * (c.mean - prev_mean) ;
+      }
+      prev_center = center ;
+      prev_mean = c.mean ;
+      cumulative += c.weight ;
+    }
+    auto t = _total > prev_center ? (target - prev_center) / (_total - prev_center) : 1 ;
+    return prev_mean + std::min(1.0, t) * (_max - prev_mean) ;
+  }
+
+private:
+  struct centroid
+  {
+    double mean ;
+    double weight ;
+  };
+
+  static double pi() { return std::acos(-1.0); }
+
+  // scale function, a centroid spans at most one unit of k
+  double k(double q) const {
+    return _compression / (2 * pi()) * std::asin(2 * q - 1) ;
+  }
+  double k_inverse(double k) const {
+    return (std::sin(k * 2 * pi() / _compression) + 1) / 2 ;
+  }
+
+  void compress() {
+    if (_buffer.empty()) return ;
+    _buffer.insert(_buffer.end(), _centroids.begin(), _centroids.end());
+    std::sort(_buffer.begin(), _buffer.end(),
+              [](const centroid& a, const centroid& b) { return a.mean < b.mean; });
+    _total = 0 ;
+    for (const auto& c : _buffer) _total += c.weight ;
+
+    _centroids.clear();
+    auto current = _buffer.front() ;
+    double done = 0 ;
+    auto limit = k_inverse(k(0) + 1) ;
+    for (std::size_t i = 1; i < _buffer.size(); ++i) {
+      const auto& c = _buffer[i] ;
+      if ((done + current.weight + c.weight) / _total <= limit) {
+        current.weight += c.weight ;
+        current.mean += (c.mean - current.mean) * c.weight / current.weight ;
+      }
+      else {
+        done += current.weight ;
+        _centroids.push_back(current);
+        limit = k_inverse(k(done / _total) + 1) ;
+        current = c ;
+      }
+    }
+    _centroids.push_back(current);
+    _buffer.clear();
+  }
+
+  double _compression ;
+  double _total = 0 ;
+  double _min = std::numeric_limits<double>::infinity() ;
+  double _max = -std::numeric_limits<double>::infinity() ;
+  std::vector<centroid> _centroids ;
+  std::vector<centroid> _buffer ;
+};
+
+// tdigest_percentile(Y, P), P in 0..100
+struct tdigest_aggregate
+{
+  tdigest digest ;
+  double p = 50 ;
+
+  void step(double v, double percent) {
+    if (percent < 0 || percent > 100)
+      throw std::domain_error("percentile must be between 0 and 100") ;
+    digest.add(v);
+    p = percent ;
+  }
+
+  double value() { return digest.quantile(p / 100); }
+};
+
+// 64 bit hash of an SQL value, equal values hash equal, 1 and 1.0 too
+uint64_t hash_value(sqlite3_value* v)
+{
+  auto mix = [](uint64_t x) {
+    x ^= x >> 30 ; x *= 0xbf58476d1ce4e5b9ull ;
+    x ^= x >> 27 ; x *= 0x94d049bb133111ebull ;
+    return x ^ (x >> 31) ;
+  };
+  auto type = sqlite3_value_type(v);
+  if (type == SQLITE_FLOAT) {
+    auto d = sqlite3_value_double(v);
+    if (d == std::floor(d) && std::abs(d) < 9e18) type = SQLITE_INTEGER ;
+    else {
+      uint64_t bits ;
+      std::memcpy(&bits, &d, sizeof bits);
+      return mix(bits ^ 0x2545f4914f6cdd1dull);
+    }
+  }
+  if (type == SQLITE_INTEGER) return mix(uint64_t(sqlite3_value_int64(v)));
+
+  auto data = static_cast<const unsigned char*>(
+      type == SQLITE_BLOB ? sqlite3_value_blob(v) : sqlite3_value_text(v));
+  auto size = sqlite3_value_bytes(v);
+  uint64_t h = 0xcbf29ce484222325ull ^ uint64_t(type) ;
+  for (int i = 0; i < size; ++i) {
+    h ^= data[i] ;
+    h *= 0x100000001b3ull ;
+  }
+  return mix(h);
+}
+
+// HyperLogLog with 2^14 registers, about 0.8% standard error
+class hyperloglog
+{
+public:
+  static const int precision = 14 ;
+
+  hyperloglog() : _registers(1u << precision) {}
+
+  void add(uint64_t hash) {
+    auto index = hash >> (64 - precision) ;
+    auto rest = (hash << precision) | (uint64_t{1} << (precision - 1)) ;
+    uint8_t rank = __builtin_clzll(rest) + 1 ;
+    _registers[index] = std::max(_registers[index], rank);
+  }
+
+  double estimate() const {
+    const double m = _registers.size() ;
+    double sum = 0 ;
+    int zeros = 0 ;
+    for (auto r : _registers) {
+      sum += std::ldexp(1.0, -r);
+      zeros += r == 0 ;
+    }
+    auto e = 0.7213 / (1 + 1.079 / m) * m * m / sum ;
+    // small range, linear counting is better
+    if (e <= 2.5 * m && zeros > 0) e = m * std::log(m / zeros);
+    return e ;
+  }
+
+private:
+  std::vector<uint8_t> _registers ;
+};
+
+// approx_count_distinct(X)
+struct hyperloglog_aggregate
+{
+  hyperloglog hll ;
+
+  void step(sqlite3_value* v) { hll.add(hash_value(v)); }
+  int64_t value() const { return int64_t(std::llround(hll.estimate())); }
+};
+
+// histogram(Y, LOW, HIGH, BUCKETS), counts as JSON array, values outside
+// [LOW, HIGH) go into the first or last bucket
+struct histogram_aggregate
+{
+  std::vector<int64_t> counts ;
+  double low = 0, high = 0 ;
+
+  std::size_t bucket(double v) const {
+    auto n = counts.size() ;
+    auto b = std::floor((v - low) / (high - low) * n) ;
+    return b < 0 ? 0 : b >= n ? n - 1 : std::size_t(b) ;
+  }
+
+  void step(double v, double lo, double hi, int64_t buckets) {
+    if (counts.empty()) {
+      if (buckets < 1 || not (lo < hi))
+        throw std::domain_error("histogram needs LOW < HIGH and BUCKETS > 0") ;
+      counts.resize(buckets);
+      low = lo ;
+      high = hi ;
+    }
+    ++counts[bucket(v)] ;
+  }
+
+  void inverse(double v, double, double, int64_t) { --counts[bucket(v)] ; }
+
+  std::string value() const {
+    std::string json = "[" ;
+    for (std::size_t i = 0; i < counts.size(); ++i)
+      json += (i ? "," : "") + std::to_string(counts[i]);
+    return json + "]" ;
+  }
+};
+
+void register_aggregates(not_null<sqlite3*> db)
+{
+  register_aggregate<percentile_aggregate>(db, "percentile");
+  register_aggregate<tdigest_aggregate>(db, "tdigest_percentile");
+  register_aggregate<hyperloglog_aggregate>(db, "approx_count_distinct");
+  register_aggregate<histogram_aggregate>(db, "histogram");
+}
+
+
+void main12()
+{
+  auto db = open_database(":memory:");
+  register_aggregates(db.get());
+  execute(db.get(), "CREATE TABLE things(id INTEGER PRIMARY KEY, name TEXT,value REAL);");
+  { Transaction transaction(db.get()) ;
+    auto add_thing = create_statement(db.get(),
+          "INSERT INTO things(name, value) VALUES(@name,@value);");
+    uint32_t random = 42 ;
+    for (int i = 0; i < 100000; ++i) {
+      random = random * 1664525u + 1013904223u ;
+      parameter(add_thing.get(), 1, std::string("thing")) ;
+      parameter(add_thing.get(), 2, double(random % 100000) / 100) ;
+      run(add_thing.get());
+    }
+    transaction.commit() ;
+  }
+
+  auto stmt = create_statement(db.get(),
+        "SELECT percentile(value, 99), tdigest_percentile(value, 99),"
+        " count(DISTINCT value), approx_count_distinct(value),"
+        " histogram(value, 0, 1000, 5) FROM things;");
+  run(stmt.get(), dump_current_row);
+  auto window = create_statement(db.get(),
+        "SELECT id, value, percentile(value, 50) OVER (ORDER BY id ROWS"
+        " BETWEEN 2 PRECEDING AND CURRENT ROW) FROM things LIMIT 4;");
+  run(window.get(), dump_current_row);
+}
+
+
+//
+// column kernels
+//
+// a numeric column fetched into a buffer plus a validity bitmap (a clear
+// bit is a NULL), and reductions and filters over it.
+// the kernels are picked once at runtime: AVX2 or SSE2 on x86-64, NEON on
+// aarch64, a scalar loop everywhere else. reductions run the kernel over
+// each run of values between NULLs.
+// for meaningful numbers build optimized,
+//   make clean all CXXFLAGS='-O2 -std=c++11 -pthread'
+//
+template<typename T>
+struct fetched_column
+{
+  std::vector<T> values ;
+  std::vector<uint64_t> valid ;
+
+  std::size_t size() const { return values.size() ; }
+  bool is_valid(std::size_t i) const { return valid[i / 64] >> (i % 64) & 1 ; }
+};
+
+template<typename T> T column_value(sqlite3_stmt* stmt, int col) ;
+template<> int64_t column_value<int64_t>(sqlite3_stmt* stmt, int col) {
+  return sqlite3_column_int64(stmt, col);
+}
+template<> double column_value<double>(sqlite3_stmt* stmt, int col) {
+  return sqlite3_column_double(stmt, col);
+}
+
+template<typename T>
+fetched_column<T> fetch_column(not_null<sqlite3_stmt*> stmt, int col = 0)
+{
+  fetched_column<T> column ;
+  run(stmt, [&](not_null<sqlite3_stmt*> row) {
+    auto i = column.values.size() ;
+    if (i % 64 == 0) column.valid.push_back(0);
+    if (sqlite3_column_type(row, col) == SQLITE_NULL)
+      column.values.push_back(0);
+    else {
+      column.values.push_back(column_value<T>(row, col));
+      column.valid.back() |= uint64_t{1} << (i % 64) ;
+    }
+    return true ;
+  });
+  return column ;
+}
+
+template<typename T>
+struct column_summary
+{
+  int64_t count = 0 ;
+  T sum = 0 ;
+  T min = std::numeric_limits<T>::has_infinity
+        ? std::numeric_limits<T>::infinity() : std::numeric_limits<T>::max() ;
+  T max = std::numeric_limits<T>::has_infinity
+        ? -std::numeric_limits<T>::infinity() : std::numeric_limits<T>::lowest() ;
+
+  double mean() const { return count ? double(sum) / count : 0 ; }
+};
+
+template<typename T>
+struct column_kernel_set
+{
+  const char* name ;
+  // all n values are valid
+  void (*reduce)(const T* values, std::size_t n, column_summary<T>& s) ;
+  // bit i set if values[i] > threshold, n <= 64
+  uint64_t (*greater)(const T* values, std::size_t n, T threshold) ;
+};
+
+namespace column_kernels {
+
+  template<typename T>
+  void reduce_scalar(const T* v, std::size_t n, column_summary<T>& s)
+  {
+    for (std::size_t i = 0; i < n; ++i) {
+      s.sum += v[i] ;
+      s.min = std::min(s.min, v[i]);
+      s.max = std::max(s.max, v[i]);
+    }
+    s.count += n ;
+  }
+
+  template<typename T>
+  uint64_t greater_scalar(const T* v, std::size_t n, T threshold)
+  {
+    uint64_t mask = 0 ;
+    for (std::size_t i = 0; i < n; ++i)
+      mask |= uint64_t(v[i] > threshold) << i ;
+    return mask ;
+  }
+
+#if defined(__x86_64__)
+  __attribute__((target("avx2")))
+  void reduce_avx2(const double* v, std::size_t n, column_summary<double>& s)
+  {
+    auto sum = _mm256_setzero_pd();
+    auto lo = _mm256_set1_pd(s.min), hi = _mm256_set1_pd(s.max);
+    std::size_t i = 0 ;
+    for (; i + 4 <= n; i += 4) {
+      auto x = _mm256_loadu_pd(v + i);
+      sum = _mm256_add_pd(sum, x);
+      lo = _mm256_min_pd(lo, x);
+      hi = _mm256_max_pd(hi, x);
+    }
+    double a[4], b[4], c[4] ;
+    _mm256_storeu_pd(a, sum);
+    _mm256_storeu_pd(b, lo);
+    _mm256_storeu_pd(c, hi);
+    s.sum += (a[0] + a[1]) + (a[2] + a[3]) ;
+    s.min = std::min(std::min(b[0], b[1]), std::min(b[2], b[3]));
+    s.max = std::max(std::max(c[0], c[1]), std::max(c[2], c[3]));
+    s.count += i ;
+    reduce_scalar(v + i, n - i, s);
+  }
+
+  __attribute__((target("avx2")))
+  void reduce_avx2(const int64_t* v, std::size_t n, column_summary<int64_t>& s)
+  {
+    auto sum = _mm256_setzero_si256();
+    auto lo = _mm256_set1_epi64x(s.min), hi = _mm256_set1_epi64x(s.max);
+    std::size_t i = 0 ;
+    for (; i + 4 <= n; i += 4) {
+      auto x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v + i));
+      sum = _mm256_add_epi64(sum, x);
+      lo = _mm256_blendv_epi8(lo, x, _mm256_cmpgt_epi64(lo, x));
+      hi = _mm256_blendv_epi8(hi, x, _mm256_cmpgt_epi64(x, hi));
+    }
+    int64_t a[4], b[4], c[4] ;
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(a), sum);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(b), lo);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(c), hi);
+    s.sum += (a[0] + a[1]) + (a[2] + a[3]) ;
+    s.min = std::min(std::min(b[0], b[1]), std::min(b[2], b[3]));
+    s.max = std::max(std::max(c[0], c[1]), std::max(c[2], c[3]));
+    s.count += i ;
+    reduce_scalar(v + i, n - i, s);
+  }
+
+  __attribute__((target("avx2")))
+  uint64_t greater_avx2(const double* v, std::size_t n, double threshold)
+  {
+    auto t = _mm256_set1_pd(threshold);
+    uint64_t mask = 0 ;
+    std::size_t i = 0 ;
+    for (; i + 4 <= n; i += 4) {
+      auto m = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(v + i), t, _CMP_GT_OQ));
+      mask |= uint64_t(m) << i ;
+    }
+    return i == n ? mask : mask | greater_scalar(v + i, n - i, threshold) << i ;
+  }
+
+  __attribute__((target("avx2")))
+  uint64_t greater_avx2(const int64_t* v, std::size_t n, int64_t threshold)
+  {
+    auto t = _mm256_set1_epi64x(threshold);
+    uint64_t mask = 0 ;
+    std::size_t i = 0 ;
+    for (; i + 4 <= n; i += 4) {
+      auto x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v + i));
+      auto m = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(x, t)));
+      mask |= uint64_t(m) << i ;
+    }
+    return i == n ? mask : mask | greater_scalar(v + i, n - i, threshold) << i ;
+  }
+
+  // SSE2 is always there on x86-64, it has no 64 bit integer compare
+  void reduce_sse2(const double* v, std::size_t n, column_summary<double>& s)
+  {
+    auto sum = _mm_setzero_pd();
+    auto lo = _mm_set1_pd(s.min), hi = _mm_set1_pd(s.max);
+    std::size_t i = 0 ;
+    for (; i + 2 <= n; i += 2) {
+      auto x = _mm_loadu_pd(v + i);
+      sum = _mm_add_pd(sum, x);
+      lo = _mm_min_pd(lo, x);
+      hi = _mm_max_pd(hi, x);
+    }
+    double a[2], b[2], c[2] ;
+    _mm_storeu_pd(a, sum);
+    _mm_storeu_pd(b, lo);
+    _mm_storeu_pd(c, hi);
+    s.sum += a[0] + a[1] ;
+    s.min = std::min(b[0], b[1]);
+    s.max = std::max(c[0], c[1]);
+    s.count += i ;
+    reduce_scalar(v + i, n - i, s);
+  }
+
+  uint64_t greater_sse2(const double* v, std::size_t n, double threshold)
+  {
+    auto t = _mm_set1_pd(threshold);
+    uint64_t mask = 0 ;
+    std::size_t i = 0 ;
+    for (; i + 2 <= n; i += 2)
+      mask |= uint64_t(_mm_movemask_pd(_mm_cmpgt_pd(_mm_loadu_pd(v + i), t))) << i ;
+    return i == n ? mask : mask | greater_scalar(v + i, n - i, threshold) << i ;
+  }
+#endif
+
+#if defined(__aarch64__)
+  void reduce_neon(const double* v, std::size_t n, column_summary<double>& s)
+  {
+    auto sum = vdupq_n_f64(0);
+    auto lo = vdupq_n_f64(s.min), hi = vdupq_n_f64(s.max);
+    std::size_t i = 0 ;
+    for (; i + 2 <= n; i += 2) {
+      auto x = vld1q_f64(v + i);
+      sum = vaddq_f64(sum, x);
+      lo = vminq_f64(lo, x);
+      hi = vmaxq_f64(hi, x);
+    }
+    s.sum += vaddvq_f64(sum);
+    s.min = vminvq_f64(lo);
+    s.max = vmaxvq_f64(hi);
+    s.count += i ;
+    reduce_scalar(v + i, n - i, s);
+  }
+
+  void reduce_neon(const int64_t* v, std::size_t n, column_summary<int64_t>& s)
+  {
+    auto sum = vdupq_n_s64(0);
+    auto lo = vdupq_n_s64(s.min), hi = vdupq_n_s64(s.max);
+    std::size_t i = 0 ;
+    for (; i + 2 <= n; i += 2) {
+      auto x = vld1q_s64(v + i);
+      sum = vaddq_s64(sum, x);
+      lo = vbslq_s64(vcgtq_s64(lo, x), x, lo);
+      hi = vbslq_s64(vcgtq_s64(x, hi), x, hi);
+    }
+    s.sum += vaddvq_s64(sum);
+    s.min = std::min(vgetq_lane_s64(lo, 0), vgetq_lane_s64(lo, 1));
+    s.max = std::max(vgetq_lane_s64(hi, 0), vgetq_lane_s64(hi, 1));
+    s.count += i ;
+    reduce_scalar(v + i, n - i, s);
+  }
+
+  uint64_t greater_neon(const double* v, std::size_t n, double threshold)
+  {
+    auto t = vdupq_n_f64(threshold);
+    uint64_t mask = 0 ;
+    std::size_t i = 0 ;
+    for (; i + 2 <= n; i += 2) {
+      auto m = vcgtq_f64(vld1q_f64(v + i), t);
+      mask |= (vgetq_lane_u64(m, 0) & 1) << i | (vgetq_lane_u64(m, 1) & 1) << (i + 1) ;
+    }
+    return i == n ? mask : mask | greater_scalar(v + i, n - i, threshold) << i ;
+  }
+
+  uint64_t greater_neon(const int64_t* v, std::size_t n, int64_t threshold)
+  {
+    auto t = vdupq_n_s64(threshold);
+    uint64_t mask = 0 ;
+    std::size_t i = 0 ;
+    for (; i + 2 <= n; i += 2) {
+      auto m = vcgtq_s64(vld1q_s64(v + i), t);
+      mask |= (vgetq_lane_u64(m, 0) & 1) << i | (vgetq_lane_u64(m, 1) & 1) << (i + 1) ;
+    }
+    return i == n ? mask : mask | greater_scalar(v + i, n - i, threshold) << i ;
+  }
+#endif
+
+  template<typename T>
+  column_kernel_set<T> scalar()
+  {
+    return column_kernel_set<T>{"scalar", &reduce_scalar<T>, &greater_scalar<T>} ;
+  }
+
+  template<typename T>
+  column_kernel_set<T> pick()
+  {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+      return column_kernel_set<T>{"avx2", &reduce_avx2, &greater_avx2} ;
+#elif defined(__aarch64__)
+    return column_kernel_set<T>{"neon", &reduce_neon, &greater_neon} ;
+#endif
+    return scalar<T>();
+  }
+
+  template<>
+  column_kernel_set<double> pick<double>()
+  {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+      return column_kernel_set<double>{"avx2", &reduce_avx2, &greater_avx2} ;
+    return column_kernel_set<double>{"sse2", &reduce_sse2, &greater_sse2} ;
+#elif defined(__aarch64__)
+    return column_kernel_set<double>{"neon", &reduce_neon, &greater_neon} ;
+#else
+    return scalar<double>();
+#endif
+  }
+}
+
+template<typename T>
+const column_kernel_set<T>& column_kernels_for()
+{
+  static const column_kernel_set<T> kernels = column_kernels::pick<T>();
+  return kernels ;
+}
+
+// the first index >= i whose valid bit is set (or clear), n if none
+inline std::size_t next_valid(const std::vector<uint64_t>& valid,
+                              std::size_t i, std::size_t n, bool set)
+{
+  while (i < n) {
+    auto word = set ? valid[i / 64] : ~valid[i / 64] ;
+    word >>= i % 64 ;
+    if (word) return std::min(n, i + __builtin_ctzll(word));
+    i = (i / 64 + 1) * 64 ;
+  }
+  return n ;
+}
+
+template<typename T>
+column_summary<T> summarize(const fetched_column<T>& column,
+                            const column_kernel_set<T>& kernels
+                                = column_kernels_for<T>())
+{
+  column_summary<T> s ;
+  const auto n = column.size() ;
+  // runs of valid values between NULLs
+  for (auto i = next_valid(column.valid, 0, n, true); i < n;) {
+    auto end = next_valid(column.valid, i, n, false) ;
+    kernels.reduce(column.values.data() + i, end - i, s);
+    i = next_valid(column.valid, end, n, true) ;
+  }
+  return s ;
+}
+
+// selection bitmap of the valid values > threshold
+template<typename T>
+std::vector<uint64_t> select_greater(const fetched_column<T>& column,
+                                     T threshold,
+                                     const column_kernel_set<T>& kernels
+                                         = column_kernels_for<T>())
+{
+  std::vector<uint64_t> selected(column.valid.size()) ;
+  for (std::size_t w = 0; w < selected.size(); ++w) {
+    auto first = w * 64, len = std::min<std::size_t>(64, column.size() - first) ;
+    if (column.valid[w])
+      selected[w] = kernels.greater(column.values.data() + first, len, threshold)
+                  & column.valid[w] ;
+  }
+  return selected ;
+}
+
+inline int64_t count_selected(const std::vector<uint64_t>& bitmap)
+{
+  int64_t n = 0 ;
+  for (auto w : bitmap) n += __builtin_popcountll(w);
+  return n ;
+}
+
+
+void main13()
+{
+  auto db = open_database(":memory:");
+  execute(db.get(), "CREATE TABLE things(id INTEGER PRIMARY KEY, name TEXT,value REAL);");
+  execute(db.get(), "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n"
+                    " WHERE i < 1000000) INSERT INTO things SELECT i, 'thing',"
+                    " CASE WHEN i % 100 = 0 THEN NULL ELSE (i * 7919) % 1000 / 10.0"
+                    " END FROM n;");
+
+  auto measure = [](std::function<void()> f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  };
+
+  auto values_stmt = create_statement(db.get(), "SELECT value FROM things;");
+  auto ids_stmt = create_statement(db.get(), "SELECT id FROM things;");
+  fetched_column<double> values ;
+  fetched_column<int64_t> ids ;
+  auto fetch = measure([&]{
+    values = fetch_column<double>(values_stmt.get());
+    ids = fetch_column<int64_t>(ids_stmt.get());
+  });
+
+  const auto& kernels = column_kernels_for<double>() ;
+  const auto& scalar = column_kernels::scalar<double>() ;
+  column_summary<double> simd_sum, scalar_sum ;
+  column_summary<int64_t> id_sum ;
+  int64_t simd_count = 0, id_count = 0 ;
+  auto simd = measure([&]{ simd_sum = summarize(values, kernels); });
+  auto plain = measure([&]{ scalar_sum = summarize(values, scalar); });
+  auto simd_ids = measure([&]{ id_sum = summarize(ids); });
+  auto filter = measure([&]{ simd_count = count_selected(select_greater(values, 50.0)); });
+  auto id_filter = measure([&]{ id_count = count_selected(select_greater(ids, int64_t{900000})); });
+
+  std::string sql_result ;
+  auto sql = measure([&]{
+    auto stmt = create_statement(db.get(),
+          "SELECT count(value), sum(value), min(value), max(value),"
+          " avg(value) FROM things;");
+    run(stmt.get(), [&](not_null<sqlite3_stmt*> row) {
+      sql_result = std::to_string(sqlite3_column_int64(row, 0)) + " rows, sum "
+                 + std::to_string(sqlite3_column_double(row, 1));
+      return false ;
+    });
+  });
+  int64_t sql_count = 0 ;
+  auto sql_filter = measure([&]{
+    sql_count = query_int64(db.get(), "SELECT count(*) FROM things WHERE value > 50;");
+  });
+
+  std::cout << "fetched 2 columns in " << fetch << "us, " << kernels.name
+            << " kernels\n"
+            << "  summary " << simd_sum.count << " rows, sum "
+            << std::to_string(simd_sum.sum) << ", min " << simd_sum.min
+            << ", max " << simd_sum.max << ", mean " << simd_sum.mean() << ": "
+            << simd << "us, scalar " << plain << "us, SQL (" << sql_result
+            << ") " << sql << "us\n"
+            << "  value > 50: " << simd_count << " in " << filter << "us, SQL "
+            << sql_count << " in " << sql_filter << "us\n"
+            << "  ids: sum " << id_sum.sum << " in " << simd_ids << "us, "
+            << id_count << " > 900000 in " << id_filter << "us\n" ;
+}
+
+
+//
+// collations
+//
+// ASCII_NOCASE orders like the built in NOCASE, NATSORT compares digit
+// runs by their numeric value, "item2" < "item10", and text case
+// insensitive. both skip the common prefix 16 bytes at a time, SSE2 on
+// x86-64, a word at a time elsewhere.
+//
+namespace collation {
+
+  inline std::size_t common_prefix(const unsigned char* a,
+                                   const unsigned char* b, std::size_t n)
+  {
+    std::size_t i = 0 ;
+#if defined(__x86_64__)
+    for (; i + 16 <= n; i += 16) {
+      auto x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+      auto y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+      auto same = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+      if (same != 0xffff) return i + __builtin_ctz(~same);
+    }
+#else
+    for (; i + 8 <= n; i += 8) {
+      uint64_t x, y ;
+      std::memcpy(&x, a + i, 8);
+      std::memcpy(&y, b + i, 8);
+      if (x != y) break ;
+    }
+#endif
+    while (i < n && a[i] == b[i]) ++i ;
+    return i ;
+  }
+
+  inline unsigned char lower(unsigned char c)
+  {
+    return c >= 'A' && c <= 'Z' ? c | 0x20 : c ;
+  }
+
+  inline bool digit(unsigned char c) { return c >= '0' && c <= '9' ; }
+
+  int ascii_nocase(void*, int n1, const void* p1, int n2, const void* p2)
+  {
+    auto a = static_cast<const unsigned char*>(p1);
+    auto b = static_cast<const unsigned char*>(p2);
+    std::size_t n = std::min(n1, n2) ;
+    std::size_t i = common_prefix(a, b, n) ;
+#if defined(__x86_64__)
+    // fold A-Z, bytes >= 0x80 are negative here and stay as they are
+    const auto before_a = _mm_set1_epi8('A' - 1), after_z = _mm_set1_epi8('Z' + 1);
+    const auto bit = _mm_set1_epi8(0x20);
+    auto fold = [&](__m128i x) {
+      auto upper = _mm_and_si128(_mm_cmpgt_epi8(x, before_a), _mm_cmplt_epi8(x, after_z));
+      return _mm_or_si128(x, _mm_and_si128(upper, bit));
+    };
+    for (; i + 16 <= n; i += 16) {
+      auto x = fold(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+      auto y = fold(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+      auto same = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+      if (same != 0xffff) {
+        i += __builtin_ctz(~same);
+        return int(lower(a[i])) - int(lower(b[i])) ;
+      }
+    }
+#endif
+    for (; i < n; ++i) {
+      auto d = int(lower(a[i])) - int(lower(b[i])) ;
+      if (d) return d ;
+    }
+    return n1 - n2 ;
+  }
+
+  int natural(void*, int n1, const void* p1, int n2, const void* p2)
+  {
+    auto a = static_cast<const unsigned char*>(p1);
+    auto b = static_cast<const unsigned char*>(p2);
+    std::size_t i = common_prefix(a, b, std::min(n1, n2)) ;
+    // a number starts before the first difference, compare all of it
+    while (i > 0 && digit(a[i - 1])) --i ;
+
+    std::size_t j = i ;
+    int zeros = 0 ;  // fewer leading zeros first, if all else is equal
+    while (i < std::size_t(n1) && j < std::size_t(n2)) {
+      if (digit(a[i]) && digit(b[j])) {
+        auto si = i, sj = j ;
+        while (i < std::size_t(n1) && a[i] == '0') ++i ;
+        while (j < std::size_t(n2) && b[j] == '0') ++j ;
+        if (not zeros) zeros = int(i - si) - int(j - sj) ;
+        auto ni = i, nj = j ;
+        while (ni < std::size_t(n1) && digit(a[ni])) ++ni ;
+        while (nj < std::size_t(n2) && digit(b[nj])) ++nj ;
+        // more digits is bigger, same length compares digit by digit
+        if (ni - i != nj - j) return int(ni - i) - int(nj - j) ;
+        for (; i < ni; ++i, ++j)
+          if (a[i] != b[j]) return int(a[i]) - int(b[j]) ;
+        continue ;
+      }
+      auto d = int(lower(a[i])) - int(lower(b[j])) ;
+      if (d) return d ;
+      ++i ; ++j ;
+    }
+    if (i < std::size_t(n1) || j < std::size_t(n2))
+      return i < std::size_t(n1) ? 1 : -1 ;
+    if (zeros) return zeros ;
+    // equal for people, keep the order total
+    auto d = std::memcmp(p1, p2, std::min(n1, n2));
+    return d ? d : n1 - n2 ;
+  }
+}
+
+void register_collations(not_null<sqlite3*> db)
+{
+  for (auto c : {std::make_pair("ASCII_NOCASE", &collation::ascii_nocase),
+                 std::make_pair("NATSORT", &collation::natural)}) {
+    auto rc = sqlite3_create_collation_v2(db, c.first, SQLITE_UTF8, nullptr,
+                                          c.second, nullptr);
+    if (rc != SQLITE_OK) {
+      std::cerr << "Unable to register collation '" << c.first << "': "
+                << sqlite3_errmsg(db);
+      std::exit(EXIT_FAILURE);
+    }
+  }
+}
+
+
+void main14()
+{
+  // 10000000 for the real numbers, it takes a while
+  const int names = 1000000 ;
+
+  auto db = open_database(":memory:");
+  register_collations(db.get());
+  execute(db.get(), "CREATE TABLE names(name TEXT);");
+  { Transaction transaction(db.get()) ;
+    auto add_name = create_statement(db.get(), "INSERT INTO names VALUES(@name);");
+    const char* prefixes[] = {"Item", "item", "ITEM-", "Thing_", "thing-long-common-prefix-"} ;
+    uint32_t random = 42 ;
+    for (int i = 0; i < names; ++i) {
+      random = random * 1664525u + 1013904223u ;
+      parameter(add_name.get(), 1, prefixes[random % 5] + std::to_string(random % 100000)) ;
+      run(add_name.get());
+    }
+    transaction.commit() ;
+  }
+
+  auto measure = [](std::function<void()> f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  };
+  std::cout << "sorting " << names << " names:" ;
+  for (auto c : {"BINARY", "NOCASE", "ASCII_NOCASE", "NATSORT"}) {
+    auto stmt = create_statement(db.get(),
+          std::string("SELECT name FROM names ORDER BY name COLLATE ") + c + ";");
+    int64_t rows = 0 ;
+    auto ms = measure([&]{
+      run(stmt.get(), [&](not_null<sqlite3_stmt*>) { ++rows ; return true ; });
+    });
+    std::cout << " " << c << " " << ms << "ms" ;
+  }
+  std::cout << "\n" ;
+
+  execute(db.get(), "CREATE INDEX names_natsort ON names(name COLLATE NATSORT);");
+  auto first = create_statement(db.get(),
+        "SELECT name FROM names WHERE name COLLATE NATSORT >= 'item9'"
+        " ORDER BY name COLLATE NATSORT LIMIT 3;");
+  auto plan = create_statement(db.get(), "EXPLAIN QUERY PLAN SELECT name FROM names"
+        " WHERE name COLLATE NATSORT >= 'item9' ORDER BY name COLLATE NATSORT LIMIT 3;");
+  run(plan.get(), dump_query_plan);
+  run(first.get(), dump_current_row);
+}
+
+
+fts5_api* fts5_api_of(not_null<sqlite3*> db)
+{
+  fts5_api* api = nullptr ;
+  auto stmt = create_statement(db, "SELECT fts5(@api);");
+  auto rc = sqlite3_bind_pointer(stmt.get(), 1, &api, "fts5_api_ptr", nullptr);
+  if (rc != SQLITE_OK) throw "TODO" ;
+  run(stmt.get());
+  return api ;
+}
+
+// one incremental merge step, SQLITE_ROW while there is more to merge,
+// SQLITE_DONE once there is nothing left, or the error, SQLITE_BUSY when
+// a writer kept the lock
+int fts_merge(not_null<sqlite3*> db, const std::string& fts, int pages = 500)
+{
+  auto before = sqlite3_total_changes(db);
+  auto rc = sqlite3_exec(db, ("INSERT INTO " + fts + "(" + fts + ", rank) VALUES("
+                              "'merge', " + std::to_string(pages) + ");").c_str(),
+                         nullptr, nullptr, nullptr);
+  if (rc != SQLITE_OK) return rc ;
+  return sqlite3_total_changes(db) - before > 1 ? SQLITE_ROW : SQLITE_DONE ;
+}
+
+int fts_optimize(not_null<sqlite3*> db, const std::string& fts)
+{
+  return sqlite3_exec(db, ("INSERT INTO " + fts + "(" + fts + ") VALUES('optimize');").c_str(),
+                      nullptr, nullptr, nullptr);
+}
+
+// fts_offsets(fts), the matches in column 0 as "offset length ..." in
+// bytes, found the way highlight() finds them but without markers that
+// could also be in the text
+namespace fts_offsets {
+
+  struct matches
+  {
+    std::vector<std::pair<int, int>> tokens ;  // first token, count, sorted
+    std::size_t next = 0 ;
+    int index = 0 ;
+    std::string result ;
+  };
+
+  int on_token(void* ctx, int flags, const char*, int, int start, int end)
+  {
+    auto m = static_cast<matches*>(ctx) ;
+    if (flags & FTS5_TOKEN_COLOCATED) return SQLITE_OK ;
+    const int index = m->index++ ;
+    while (m->next < m->tokens.size()
+           && m->tokens[m->next].first + m->tokens[m->next].second <= index)
+      ++m->next ;
+    if (m->next < m->tokens.size() && m->tokens[m->next].first <= index)
+      m->result += std::to_string(start) + " " + std::to_string(end - start) + " " ;
+    return SQLITE_OK ;
+  }
+
+  void function(const Fts5ExtensionApi* api, Fts5Context* fts,
+                sqlite3_context* ctx, int, sqlite3_value**)
+  {
+    matches m ;
+    int count = 0 ;
+    int rc = api->xInstCount(fts, &count);
+    for (int i = 0; rc == SQLITE_OK && i < count; ++i) {
+      int phrase = 0, column = 0, offset = 0 ;
+      rc = api->xInst(fts, i, &phrase, &column, &offset);
+      if (column == 0) m.tokens.emplace_back(offset, api->xPhraseSize(fts, phrase));
+    }
+    std::sort(m.tokens.begin(), m.tokens.end());
+    const char* text = nullptr ;
+    int size = 0 ;
+    if (rc == SQLITE_OK) rc = api->xColumnText(fts, 0, &text, &size);
+    if (rc == SQLITE_OK && text)
+      rc = api->xTokenize(fts, text, size, &m, on_token);
+    if (rc != SQLITE_OK) sqlite3_result_error_code(ctx, rc);
+    else sqlite3_result_text(ctx, m.result.data(), m.result.size(), SQLITE_TRANSIENT);
+  }
+}
+
+void register_fts_offsets(not_null<sqlite3*> db)
+{
+  auto api = fts5_api_of(db) ;
+  if (not api || api->xCreateFunction(api, "fts_offsets", nullptr,
+                                      fts_offsets::function, nullptr) != SQLITE_OK) {
+    std::cerr << "Unable to register fts_offsets: " << sqlite3_errmsg(db);
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+//
+// full text index on a text column
+//
+// an external content FTS5 table, <table>_<column>_fts, indexes the column
+// without a second copy of the text. it is kept in sync by triggers, or,
+// batched, by triggers that only log the changed rows until sync().
+//
+enum class fts_sync { triggers, batched } ;
+
+struct fts_hit
+{
+  int64_t id ;
+  double score ;  // bm25, smaller is better
+  std::vector<std::pair<std::size_t, std::size_t>> matches ; // offset, length
+};
+
+class full_text_index
+{
+public:
+  full_text_index(not_null<sqlite3*> db,
+                  const std::string& table,
+                  const std::string& column,
+                  const std::string& key = "id",
+                  fts_sync sync = fts_sync::triggers,
+                  const std::string& tokenizer = "unicode61")
+  : _db{db}
+  , _name{table + "_" + column + "_fts"}
+  , _table{table}
+  , _column{column}
+  , _key{key}
+  , _sync{sync}
+  {
+    Transaction transaction(_db) ;
+    auto exists = query_int64(_db, "SELECT count(*) FROM sqlite_master WHERE"
+                                   " name = '" + _name + "';");
+    execute(_db, ("CREATE VIRTUAL TABLE IF NOT EXISTS " + _name
+                  + " USING fts5(" + column + ", content='" + table
+                  + "', content_rowid='" + key + "', tokenize='" + tokenizer
+                  + "');").c_str());
+    if (_sync == fts_sync::triggers) create_triggers();
+    else create_log();
+    if (not exists) rebuild();
+    transaction.commit() ;
+
+    register_fts_offsets(_db);
+    _search = create_statement(_db,
+        "SELECT rowid, bm25(" + _name + "), fts_offsets(" + _name
+        + ") FROM " + _name + " WHERE " + _name
+        + " MATCH @query ORDER BY rank LIMIT @limit;");
+  }
+
+  const std::string& name() const { return _name ; }
+
+  // a batched index catches up with the table, one transaction
+  void sync() {
+    if (_sync != fts_sync::batched) return ;
+    const auto log = _name + "_log" ;
+    Transaction transaction(_db) ;
+    // what the index has is the old text of the first change of a row
+    execute(_db, ("INSERT INTO " + _name + "(" + _name + ", rowid, " + _column
+                  + ") SELECT 'delete', row, old FROM " + log + " WHERE indexed"
+                  " AND seq IN (SELECT min(seq) FROM " + log + " GROUP BY row);"
+                  ).c_str());
+    execute(_db, ("INSERT INTO " + _name + "(rowid, " + _column + ") SELECT "
+                  + _key + ", " + _column + " FROM " + _table + " WHERE " + _key
+                  + " IN (SELECT row FROM " + log + ");").c_str());
+    execute(_db, ("DELETE FROM " + log + ";").c_str());
+    transaction.commit() ;
+  }
+
+  std::vector<fts_hit> search(const std::string& query, int64_t limit = 10) {
+    std::vector<fts_hit> hits ;
+    parameter(_search.get(), 1, query) ;
+    parameter(_search.get(), 2, limit) ;
+    run(_search.get(), [&](not_null<sqlite3_stmt*> row) {
+      fts_hit hit{sqlite3_column_int64(row, 0), sqlite3_column_double(row, 1), {}} ;
+      auto offsets = reinterpret_cast<const char*>(sqlite3_column_text(row, 2));
+      for (char* end = nullptr; offsets && *offsets; offsets = end) {
+        auto start = std::strtoul(offsets, &end, 10) ;
+        auto length = std::strtoul(end, &end, 10) ;
+        if (*end == ' ') ++end ;
+        hit.matches.emplace_back(start, length);
+      }
+      hits.push_back(std::move(hit));
+      return true ;
+    });
+    return hits ;
+  }
+
+  void rebuild() {
+    execute(_db, ("INSERT INTO " + _name + "(" + _name + ") VALUES('rebuild');").c_str());
+  }
+
+private:
+  void create_triggers() {
+    const auto trigger = "CREATE TRIGGER IF NOT EXISTS " + _name ;
+    const auto remove = "INSERT INTO " + _name + "(" + _name + ", rowid, "
+                      + _column + ") VALUES('delete', old." + _key + ", old."
+                      + _column + ");" ;
+    const auto add = "INSERT INTO " + _name + "(rowid, " + _column
+                   + ") VALUES(new." + _key + ", new." + _column + ");" ;
+    execute(_db, (trigger + "_insert AFTER INSERT ON " + _table + " BEGIN "
+                  + add + " END;").c_str());
+    execute(_db, (trigger + "_delete AFTER DELETE ON " + _table + " BEGIN "
+                  + remove + " END;").c_str());
+    execute(_db, (trigger + "_update AFTER UPDATE OF " + _key + ", " + _column
+                  + " ON " + _table + " BEGIN " + remove + add + " END;").c_str());
+  }
+
+  void create_log() {
+    const auto log = _name + "_log" ;
+    const auto trigger = "CREATE TRIGGER IF NOT EXISTS " + _name ;
+    execute(_db, ("CREATE TABLE IF NOT EXISTS " + log + "(seq INTEGER PRIMARY"
+                  " KEY, row INTEGER, old TEXT, indexed INTEGER);").c_str());
+    execute(_db, (trigger + "_insert AFTER INSERT ON " + _table + " BEGIN"
+                  " INSERT INTO " + log + "(row, indexed) VALUES(new." + _key
+                  + ", 0); END;").c_str());
+    execute(_db, (trigger + "_delete AFTER DELETE ON " + _table + " BEGIN"
+                  " INSERT INTO " + log + "(row, old, indexed) VALUES(old." + _key
+                  + ", old." + _column + ", 1); END;").c_str());
+    execute(_db, (trigger + "_update AFTER UPDATE OF " + _key + ", " + _column
+                  + " ON " + _table + " BEGIN INSERT INTO " + log
+                  + "(row, old, indexed) VALUES(old." + _key + ", old." + _column
+                  + ", 1); INSERT INTO " + log + "(row, indexed) VALUES(new."
+                  + _key + ", 0); END;").c_str());
+  }
+
+  sqlite3* _db ;
+  std::string _name ;
+  std::string _table ;
+  std::string _column ;
+  std::string _key ;
+  fts_sync _sync ;
+  statement _search{nullptr, sqlite3_finalize} ;
+};
+
+//
+// keeps a full text index from fragmenting: incremental merges while
+// there is something to merge, an optimize once the index grew by
+// optimize_growth pages since the last one. runs on an own connection.
+// with take_automerge the writers stop merging on commit (automerge=0)
+// while it runs, it does that work in the background instead, stop()
+// gives them the automerge they had. that value is kept in the table
+// fts_maintenance until then, so after a crash the next fts_maintenance
+// of the index restores it.
+//
+struct fts_maintenance_settings
+{
+  std::chrono::milliseconds interval{1000} ;
+  int merge_pages = 500 ;
+  int64_t optimize_growth = 10000 ;
+  bool take_automerge = true ;
+};
+
+class fts_maintenance
+{
+public:
+  fts_maintenance(const std::string& filename,
+                  const std::string& fts,
+                  fts_maintenance_settings settings = fts_maintenance_settings{})
+  : _db{open_database(filename.c_str())}
+  , _fts{fts}
+  , _settings(settings)
+  {
+    sqlite3_busy_timeout(_db.get(), 1000);
+    if (_settings.take_automerge) take_automerge();
+    _pages = pages();
+    _thread = std::thread(&fts_maintenance::loop, this);
+  }
+
+  ~fts_maintenance() { stop(); }
+
+  void stop() {
+    { std::lock_guard<std::mutex> lock(_mutex);
+      if (_stop) return ;
+      _stop = true ;
+    }
+    _wakeup.notify_one();
+    if (_thread.joinable()) _thread.join();
+    if (_settings.take_automerge) give_back_automerge();
+  }
+
+  int merges() const { std::lock_guard<std::mutex> lock(_mutex); return _merges ; }
+  int optimizes() const { std::lock_guard<std::mutex> lock(_mutex); return _optimizes ; }
+  int busy() const { std::lock_guard<std::mutex> lock(_mutex); return _busy ; }
+
+private:
+  void loop() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (not _stop) {
+      _wakeup.wait_for(lock, _settings.interval);
+      if (_stop) break ;
+      lock.unlock();
+      bool optimize = pages() - _pages >= _settings.optimize_growth ;
+      int merged = 0 ;
+      int rc = SQLITE_OK ;
+      if (optimize) {
+        rc = fts_optimize(_db.get(), _fts);
+        if (rc == SQLITE_OK) _pages = pages();
+      }
+      else while ((rc = fts_merge(_db.get(), _fts, _settings.merge_pages)) == SQLITE_ROW) {
+        ++merged ;
+        if (stopping()) break ;
+      }
+      // the writers had the lock for longer than the busy timeout,
+      // the work is still there on the next round
+      bool busy = (rc & 0xff) == SQLITE_BUSY || (rc & 0xff) == SQLITE_LOCKED ;
+      if (rc != SQLITE_OK && rc != SQLITE_ROW && rc != SQLITE_DONE && not busy) {
+        std::cerr << "fts maintenance of " << _fts << " failed: "
+                  << sqlite3_errmsg(_db.get()) << "\n" ;
+        std::exit(EXIT_FAILURE);
+      }
+      lock.lock();
+      _merges += merged ;
+      _optimizes += optimize && rc == SQLITE_OK ;
+      _busy += busy ;
+    }
+  }
+
+  bool stopping() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stop ;
+  }
+
+  void automerge(int64_t segments) {
+    execute(_db.get(), ("INSERT INTO " + _fts + "(" + _fts + ", rank) VALUES("
+                        "'automerge', " + std::to_string(segments) + ");").c_str());
+  }
+
+  void take_automerge() {
+    Transaction transaction(_db.get(), true) ;
+    execute(_db.get(), "CREATE TABLE IF NOT EXISTS fts_maintenance("
+                       "fts TEXT PRIMARY KEY, automerge INTEGER);");
+    auto saved = create_statement(_db.get(),
+          "SELECT automerge FROM fts_maintenance WHERE fts = @fts;");
+    parameter(saved.get(), 1, _fts) ;
+    // a saved value is from a run that did not stop, the index has 0 now
+    if (not fetch_int64(saved.get(), _automerge)) {
+      auto configured = create_statement(_db.get(),
+            "SELECT v FROM " + _fts + "_config WHERE k = 'automerge';");
+      if (not fetch_int64(configured.get(), _automerge)) _automerge = 4 ;
+      auto save = create_statement(_db.get(),
+            "INSERT INTO fts_maintenance VALUES(@fts, @automerge);");
+      parameter(save.get(), 1, _fts) ;
+      parameter(save.get(), 2, _automerge) ;
+      run(save.get());
+    }
+    automerge(0);
+    transaction.commit() ;
+  }
+
+  void give_back_automerge() {
+    Transaction transaction(_db.get(), true) ;
+    automerge(_automerge);
+    auto forget = create_statement(_db.get(),
+          "DELETE FROM fts_maintenance WHERE fts = @fts;");
+    parameter(forget.get(), 1, _fts) ;
+    run(forget.get());
+    transaction.commit() ;
+  }
+
+  // rows of the shadow data table, about the pages of the index
+  int64_t pages() {
+    return query_int64(_db.get(), "SELECT count(*) FROM " + _fts + "_data;");
+  }
+
+  database _db ;
+  std::string _fts ;
+  fts_maintenance_settings _settings ;
+  int64_t _pages = 0 ;
+  int64_t _automerge = 4 ;
+
+  mutable std::mutex _mutex ;
+  std::condition_variable _wakeup ;
+  bool _stop = false ;
+  int _merges = 0 ;
+  int _optimizes = 0 ;
+  int _busy = 0 ;
+  std::thread _thread ;
+};
+
+
+void print_hits(const std::string& query, const std::vector<fts_hit>& hits)
+{
+  std::cout << "'" << query << "':" ;
+  for (const auto& hit : hits) {
+    std::cout << " " << hit.id << " (" << hit.score << " at" ;
+    for (const auto& m : hit.matches) std::cout << " " << m.first << "+" << m.second ;
+    std::cout << ")" ;
+  }
+  std::cout << "\n" ;
+}
+
+void main15()
+{
+  const std::string filename = "fts_sample.db" ;
+  remove_database(filename);
+
+  auto db = open_database(filename.c_str());
+  sqlite3_busy_timeout(db.get(), 1000);
+  execute(db.get(), "PRAGMA journal_mode=WAL;");
+  execute(db.get(), "CREATE TABLE things(id INTEGER PRIMARY KEY, name TEXT,value REAL);");
+  const char* words[] = {"red", "green", "blue", "small", "large", "round",
+                         "square", "heavy", "light", "thing"} ;
+  { Transaction transaction(db.get()) ;
+    auto add_thing = create_statement(db.get(),
+          "INSERT INTO things(name, value) VALUES(@name,@value);");
+    uint32_t random = 42 ;
+    for (int i = 0; i < 20000; ++i) {
+      std::string name ;
+      for (int w = 0; w < 4; ++w) {
+        random = random * 1664525u + 1013904223u ;
+        name += std::string(w ? " " : "") + words[random >> 16 & 7] ;
+      }
+      parameter(add_thing.get(), 1, name + " " + std::to_string(i)) ;
+      parameter(add_thing.get(), 2, double(i)) ;
+      run(add_thing.get());
+    }
+    transaction.commit() ;
+  }
+
+  full_text_index names(db.get(), "things", "name");
+  print_hits("heavy AND round AND 4*", names.search("heavy AND round AND 4*", 3));
+  execute(db.get(), "UPDATE things SET name = 'brand new thing' WHERE id = 7;");
+  print_hits("brand new", names.search("brand new"));
+
+  const auto fts = names.name() ;
+  auto configured = [&]() {
+    return query_int64(db.get(), "SELECT v FROM " + fts + "_config WHERE k = 'automerge';");
+  };
+  execute(db.get(), ("INSERT INTO " + fts + "(" + fts + ", rank) VALUES('automerge', 8);").c_str());
+  fts_maintenance_settings settings ;
+  settings.interval = std::chrono::milliseconds(20) ;
+  settings.optimize_growth = 100 ;
+  { fts_maintenance maintenance(filename, fts, settings);
+    std::cout << "automerge 8, while maintained " << configured() ;
+    auto add_thing = create_statement(db.get(), "INSERT INTO things(name)"
+          " VALUES('late thing ' || @i || ' ' || @words);");
+    std::string many ;
+    for (int w = 0; w < 200; ++w) many += words[w % 10] + std::to_string(w) + " " ;
+    // small commits, each a new segment, more than automerge would leave
+    for (int i = 0; i < 2000; ++i) {
+      parameter(add_thing.get(), 1, int64_t(i)) ;
+      parameter(add_thing.get(), 2, many) ;
+      run(add_thing.get());
+    }
+    // the first step waits for the write lock, which the commits keep busy
+    for (int wait = 0; wait < 250 && maintenance.merges() + maintenance.optimizes() == 0; ++wait)
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    maintenance.stop();
+    std::cout << ", after " << configured() << ", merged in the background "
+              << std::boolalpha << (maintenance.merges() + maintenance.optimizes() > 0)
+              << "\n" ;
+  }
+  // a maintenance that did not stop left automerge 0 and its saved value
+  execute(db.get(), ("INSERT INTO fts_maintenance VALUES('" + fts + "', 8);"
+                     "INSERT INTO " + fts + "(" + fts + ", rank) VALUES('automerge', 0);").c_str());
+  fts_maintenance(filename, fts, settings).stop();
+  std::cout << "automerge after a crash and the next maintenance " << configured() << "\n" ;
+  print_hits("late AND 1999", names.search("late AND 1999"));
+
+  full_text_index batched(db.get(), "things", "value", "id", fts_sync::batched);
+  execute(db.get(), "UPDATE things SET value = 123456 WHERE id = 1;");
+  print_hits("123456 before sync", batched.search("123456"));
+  batched.sync();
+  print_hits("123456 after sync", batched.search("123456"));
+
+  db.reset();
+  remove_database(filename);
+}
+
+
+//
+// FTS5 tokenizer with an ASCII fast path
+//
+// 'fast_ascii' splits the text with a byte class table, tokens are runs
+// of ASCII letters and digits, folded to lower case. a run that has non
+// ASCII bytes goes to unicode61, so those tokens are the same as with the
+// default tokenizer.
+// it is about as fast as unicode61 (main16 measures), what it adds are
+// the options:
+//   trigram  - ASCII tokens longer than 3 bytes become their 3 byte grams,
+//              in queries too, so a term of 3 or more bytes matches
+//              anywhere inside a word, a shorter one only whole tokens
+//   prefix N - documents also get the first 1..N bytes of each ASCII token
+//              as colocated tokens, every term then matches as prefix
+//
+namespace fast_tokenizer {
+
+  using token_callback = int (*)(void*, int, const char*, int, int, int) ;
+
+  struct tokenizer
+  {
+    fts5_tokenizer unicode ;
+    Fts5Tokenizer* unicode_instance = nullptr ;
+    bool trigram = false ;
+    int prefix = 0 ;
+    std::string buffer ;  // for long tokens
+
+    ~tokenizer() { if (unicode_instance) unicode.xDelete(unicode_instance); }
+  };
+
+  // 1 for ASCII letters and digits, 2 for bytes >= 0x80, 0 between tokens
+  struct byte_classes
+  {
+    unsigned char of[256] ;
+
+    byte_classes() {
+      for (int c = 0; c < 256; ++c)
+        of[c] = c >= 0x80 ? 2
+              : (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') ;
+    }
+  };
+  const byte_classes classes ;
+
+  struct shifted
+  {
+    void* ctx ;
+    token_callback token ;
+    int offset ;
+  };
+
+  int shift(void* p, int flags, const char* token, int size, int start, int end)
+  {
+    auto s = static_cast<shifted*>(p);
+    return s->token(s->ctx, flags, token, size, start + s->offset, end + s->offset);
+  }
+
+  int create(void* ctx, const char** args, int argc, Fts5Tokenizer** out)
+  {
+    auto api = static_cast<fts5_api*>(ctx);
+    std::unique_ptr<tokenizer> t{new tokenizer{}} ;
+    void* unicode_ctx = nullptr ;
+    auto rc = api->xFindTokenizer(api, "unicode61", &unicode_ctx, &t->unicode);
+    if (rc == SQLITE_OK)
+      rc = t->unicode.xCreate(unicode_ctx, nullptr, 0, &t->unicode_instance);
+    if (rc != SQLITE_OK) return rc ;
+    for (int i = 0; i < argc; ++i) {
+      std::string arg = args[i] ;
+      if (arg == "trigram") t->trigram = true ;
+      else if (arg == "prefix" && i + 1 < argc) t->prefix = std::atoi(args[++i]);
+      else return SQLITE_ERROR ;
+    }
+    *out = reinterpret_cast<Fts5Tokenizer*>(t.release());
+    return SQLITE_OK ;
+  }
+
+  void destroy(Fts5Tokenizer* p)
+  {
+    delete reinterpret_cast<tokenizer*>(p);
+  }
+
+  int emit_ascii(tokenizer& t, void* ctx, int flags, token_callback token,
+                 const char* text, int start, int end)
+  {
+    const int size = end - start ;
+    char small[64] ;
+    if (size > 64) t.buffer.resize(size);
+    const auto data = size > 64 ? &t.buffer[0] : small ;
+    for (int i = 0; i < size; ++i) {
+      auto c = text[start + i] ;
+      data[i] = c >= 'A' && c <= 'Z' ? c | 0x20 : c ;
+    }
+    int rc = SQLITE_OK ;
+    if (t.trigram && size > 3) {
+      for (int k = 0; rc == SQLITE_OK && k + 3 <= size; ++k)
+        rc = token(ctx, 0, data + k, 3, start + k, start + k + 3);
+      return rc ;
+    }
+    rc = token(ctx, 0, data, size, start, end);
+    if (t.prefix > 0 && (flags & FTS5_TOKENIZE_DOCUMENT))
+      for (int k = 1; rc == SQLITE_OK && k <= t.prefix && k < size; ++k)
+        rc = token(ctx, FTS5_TOKEN_COLOCATED, data, k, start, end);
+    return rc ;
+  }
+
+  int emit(tokenizer& t, void* ctx, int flags, token_callback token,
+           const char* text, std::size_t start, std::size_t end, bool high)
+  {
+    if (not high) return emit_ascii(t, ctx, flags, token, text, start, end);
+    shifted s{ctx, token, int(start)} ;
+    return t.unicode.xTokenize(t.unicode_instance, &s, flags, text + start,
+                               end - start, &shift);
+  }
+
+  int tokenize(Fts5Tokenizer* p, void* ctx, int flags, const char* text,
+               int n, token_callback token)
+  {
+    auto& t = *reinterpret_cast<tokenizer*>(p);
+    auto bytes = reinterpret_cast<const unsigned char*>(text);
+    for (int pos = 0; pos < n; ) {
+      while (pos < n && not classes.of[bytes[pos]]) ++pos ;
+      if (pos == n) break ;
+      const int start = pos ;
+      unsigned char seen = 0 ;
+      for (unsigned char c; pos < n && (c = classes.of[bytes[pos]]); ++pos) seen |= c ;
+      auto rc = emit(t, ctx, flags, token, text, start, pos, seen & 2);
+      if (rc != SQLITE_OK) return rc ;
+    }
+    return SQLITE_OK ;
+  }
+}
+
+void register_fast_tokenizer(not_null<sqlite3*> db)
+{
+  auto api = fts5_api_of(db);
+  fts5_tokenizer methods{fast_tokenizer::create, fast_tokenizer::destroy,
+                         fast_tokenizer::tokenize} ;
+  auto rc = api ? api->xCreateTokenizer(api, "fast_ascii", api, &methods, nullptr)
+                : SQLITE_ERROR ;
+  if (rc != SQLITE_OK) {
+    std::cerr << "Unable to register tokenizer fast_ascii: " << sqlite3_errmsg(db);
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+
+void main16()
+{
+  auto db = open_database(":memory:");
+  register_fast_tokenizer(db.get());
+  execute(db.get(), "CREATE TABLE things(id INTEGER PRIMARY KEY, name TEXT,value REAL);");
+  const char* words[] = {"Red", "green", "BLUE", "small", "large", "round",
+                         "square", "heavy", "light", "thing"} ;
+  { Transaction transaction(db.get()) ;
+    auto add_thing = create_statement(db.get(),
+          "INSERT INTO things(name, value) VALUES(@name,@value);");
+    uint32_t random = 42 ;
+    for (int i = 0; i < 500000; ++i) {
+      std::string name ;
+      for (int w = 0; w < 3; ++w) {
+        random = random * 1664525u + 1013904223u ;
+        name += std::string(w ? " " : "") + words[random >> 16 & 7] ;
+      }
+      parameter(add_thing.get(), 1, name + "-" + std::to_string(i)) ;
+      parameter(add_thing.get(), 2, double(i)) ;
+      run(add_thing.get());
+    }
+    parameter(add_thing.get(), 1, std::string("Größe Straße")) ;
+    parameter(add_thing.get(), 2, 0.0) ;
+    run(add_thing.get());
+    transaction.commit() ;
+  }
+
+  auto measure = [](std::function<void()> f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  };
+  // the tokenizers alone, without building the index
+  std::vector<std::string> names ;
+  auto all = create_statement(db.get(), "SELECT name FROM things;");
+  run(all.get(), [&](not_null<sqlite3_stmt*> row) {
+    names.push_back(sql_arg<std::string>::get(sqlite3_column_value(row, 0)));
+    return true ;
+  });
+  auto api = fts5_api_of(db.get());
+  for (auto name : {"unicode61", "fast_ascii"}) {
+    void* ctx = nullptr ;
+    fts5_tokenizer methods ;
+    Fts5Tokenizer* instance = nullptr ;
+    api->xFindTokenizer(api, name, &ctx, &methods);
+    methods.xCreate(ctx, nullptr, 0, &instance);
+    int64_t tokens = 0 ;
+    auto count = [](void* n, int, const char*, int, int, int) {
+      ++*static_cast<int64_t*>(n);
+      return SQLITE_OK ;
+    };
+    auto ms = measure([&]{
+      for (const auto& n : names)
+        methods.xTokenize(instance, &tokens, FTS5_TOKENIZE_DOCUMENT,
+                          n.data(), n.size(), count);
+    });
+    methods.xDelete(instance);
+    std::cout << name << ": " << tokens << " tokens in " << ms << "ms\n" ;
+  }
+
+  for (auto tokenizer : {"unicode61", "fast_ascii", "fast_ascii trigram"}) {
+    execute(db.get(), (std::string("CREATE VIRTUAL TABLE names USING fts5(name,"
+                       " tokenize='") + tokenizer + "');").c_str());
+    auto ms = measure([&]{
+      execute(db.get(), "INSERT INTO names(rowid, name) SELECT id, name FROM things;");
+    });
+    std::cout << tokenizer << ": indexed in " << ms << "ms, 'heavy round' "
+              << query_int64(db.get(), "SELECT count(*) FROM names"
+                                       " WHERE names MATCH 'heavy round';")
+              << ", 'größe' "
+              << query_int64(db.get(), "SELECT count(*) FROM names"
+                                       " WHERE names MATCH 'größe';")
+              << ", 'eav' "
+              << query_int64(db.get(), "SELECT count(*) FROM names"
+                                       " WHERE names MATCH 'eav';") << "\n" ;
+    execute(db.get(), "DROP TABLE names;");
+  }
+  auto rc = sqlite3_exec(db.get(), "CREATE VIRTUAL TABLE names USING fts5(name,"
+                         " tokenize='fast_ascii bigram');", nullptr, nullptr, nullptr);
+  std::cout << "fast_ascii bigram: " << sqlite3_errstr(rc) << "\n" ;
+}
+
+
+//
+// REGEXP
+//
+// X REGEXP Y calls regexp(Y, X). compiled patterns are kept per
+// connection in a small LRU cache and per statement in the auxdata of the
+// pattern argument, so a constant pattern compiles at most once.
+// SQLite can not use an index for REGEXP, regexp_query adds the range of
+// an anchored literal prefix, which it can.
+//
+class regex_cache
+{
+public:
+  using regex_ptr = std::shared_ptr<const std::regex> ;
+
+  explicit regex_cache(std::size_t capacity) : _capacity(capacity) {}
+
+  regex_ptr get(const std::string& pattern) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _index.find(pattern);
+    if (it != _index.end()) {
+      _entries.splice(_entries.begin(), _entries, it->second);
+      return it->second->second ;
+    }
+    auto re = std::make_shared<const std::regex>(pattern);
+    _entries.emplace_front(pattern, re);
+    _index[pattern] = _entries.begin() ;
+    if (_entries.size() > _capacity) {
+      _index.erase(_entries.back().first);
+      _entries.pop_back();
+    }
+    ++_compiled ;
+    return re ;
+  }
+
+  std::size_t compiled() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _compiled ;
+  }
+
+private:
+  using entry = std::pair<std::string, regex_ptr> ;
+  std::size_t _capacity ;
+  std::size_t _compiled = 0 ;
+  std::list<entry> _entries ;
+  std::unordered_map<std::string, std::list<entry>::iterator> _index ;
+  mutable std::mutex _mutex ;
+};
+
+std::shared_ptr<regex_cache> register_regexp(not_null<sqlite3*> db,
+                                             std::size_t capacity = 32)
+{
+  auto cache = std::make_shared<regex_cache>(capacity);
+  register_function(db, "regexp",
+      [cache](sqlite3_context* ctx, const std::string& pattern, text_view text) {
+    auto& re = cached<regex_cache::regex_ptr>(ctx, 0, [&]() {
+      return cache->get(pattern);
+    });
+    return std::regex_search(text.data, text.data + text.size, *re);
+  });
+  return cache ;
+}
+
+// [lower, upper) for values matching an anchored pattern with a literal
+// prefix, empty lower if there is none, empty upper if unbounded
+struct regexp_bounds
+{
+  std::string lower ;
+  std::string upper ;
+};
+
+regexp_bounds regexp_prefix_bounds(const std::string& pattern)
+{
+  regexp_bounds bounds ;
+  // an alternative anywhere could match without the prefix
+  for (std::size_t i = 0; i < pattern.size(); ++i) {
+    if (pattern[i] == '\\') ++i ;
+    else if (pattern[i] == '|') return bounds ;
+  }
+  if (pattern.empty() || pattern[0] != '^') return bounds ;
+
+  const std::string meta = "^$.*+?()[]{}|\\" ;
+  std::string prefix ;
+  for (std::size_t i = 1; i < pattern.size(); ++i) {
+    auto c = pattern[i] ;
+    bool escaped = c == '\\' && i + 1 < pattern.size()
+                && meta.find(pattern[i + 1]) != std::string::npos ;
+    if (escaped) c = pattern[++i] ;
+    else if (meta.find(c) != std::string::npos) {
+      // a quantifier makes the last character optional or repeated
+      if ((c == '*' || c == '?' || c == '{') && not prefix.empty())
+        prefix.pop_back();
+      break ;
+    }
+    prefix += c ;
+  }
+  bounds.lower = prefix ;
+  // the smallest string after all that start with prefix
+  while (not prefix.empty() && uint8_t(prefix.back()) == 0xff) prefix.pop_back();
+  if (not prefix.empty()) {
+    prefix.back() = char(uint8_t(prefix.back()) + 1) ;
+    bounds.upper = prefix ;
+  }
+  return bounds ;
+}
+
+// select ... WHERE column REGEXP pattern, plus the prefix range if any
+statement regexp_query(not_null<sqlite3*> db,
+                       const std::string& select,
+                       const std::string& column,
+                       const std::string& pattern)
+{
+  auto bounds = regexp_prefix_bounds(pattern);
+  auto sql = select + " WHERE " + column + " REGEXP @pattern" ;
+  if (not bounds.lower.empty()) sql += " AND " + column + " >= @lower" ;
+  if (not bounds.upper.empty()) sql += " AND " + column + " < @upper" ;
+  auto stmt = create_statement(db, sql + ";");
+  parameter(stmt.get(), 1, pattern) ;
+  if (not bounds.lower.empty()) parameter(stmt.get(), 2, bounds.lower) ;
+  if (not bounds.upper.empty()) parameter(stmt.get(), 3, bounds.upper) ;
+  return stmt ;
+}
+
+
+void main17()
+{
+  auto db = open_database(":memory:");
+  auto cache = register_regexp(db.get());
+  execute(db.get(), "CREATE TABLE things(id INTEGER PRIMARY KEY, name TEXT,value REAL);");
+  execute(db.get(), "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n"
+                    " WHERE i < 100000) INSERT INTO things SELECT i, 'thing' || i, i FROM n;");
+  execute(db.get(), "CREATE INDEX things_name ON things(name);");
+
+  auto measure = [](std::function<void()> f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  };
+  const std::string pattern = "^thing12[0-9]$" ;
+  auto count = [](not_null<sqlite3_stmt*> stmt) {
+    int64_t n = 0 ;
+    run(stmt, [&](not_null<sqlite3_stmt*>) { ++n ; return true ; });
+    return n ;
+  };
+
+  int64_t scanned = 0, ranged = 0 ;
+  auto scan = create_statement(db.get(), "SELECT id FROM things WHERE name REGEXP @p;");
+  parameter(scan.get(), 1, pattern) ;
+  auto scan_us = measure([&]{ scanned = count(scan.get()); });
+  auto range = regexp_query(db.get(), "SELECT id FROM things", "name", pattern);
+  auto range_us = measure([&]{ ranged = count(range.get()); });
+
+  auto bounds = regexp_prefix_bounds(pattern);
+  std::cout << "'" << pattern << "' prefix ['" << bounds.lower << "', '"
+            << bounds.upper << "'): scan " << scanned << " in " << scan_us
+            << "us, index range " << ranged << " in " << range_us << "us, "
+            << cache->compiled() << " compiled\n" ;
+  auto plan = create_statement(db.get(), "EXPLAIN QUERY PLAN SELECT id FROM things"
+        " WHERE name REGEXP '^thing12' AND name >= 'thing12' AND name < 'thing13';");
+  run(plan.get(), dump_query_plan);
+}
+
+
+//
+// R*Tree index for 2D boxes
+//
+// an rtree table <table>_rtree mirrors the bounding box columns of a table,
+// kept in sync by triggers. queries go to the rtree and join back to the
+// table. the rtree stores 32 bit floats, rounded outwards, so it is only
+// asked for overlapping boxes, the exact test runs on the table's columns.
+//
+struct box
+{
+  double min_x, max_x, min_y, max_y ;
+};
+
+struct box_columns
+{
+  std::string min_x = "min_x" ;
+  std::string max_x = "max_x" ;
+  std::string min_y = "min_y" ;
+  std::string max_y = "max_y" ;
+};
+
+class spatial_index
+{
+public:
+  spatial_index(not_null<sqlite3*> db,
+                const std::string& table,
+                const std::string& key = "id",
+                box_columns columns = box_columns{})
+  : _db{db}
+  , _table{table}
+  , _name{table + "_rtree"}
+  , _key{key}
+  , _c(columns)
+  {
+    const auto boxes = _c.min_x + ", " + _c.max_x + ", " + _c.min_y + ", " + _c.max_y ;
+    const auto values = [&](const std::string& row) {
+      return row + _key + ", " + row + _c.min_x + ", " + row + _c.max_x + ", "
+           + row + _c.min_y + ", " + row + _c.max_y ;
+    };
+    const auto trigger = "CREATE TRIGGER IF NOT EXISTS " + _name ;
+    const auto remove = "DELETE FROM " + _name + " WHERE id = old." + _key + ";" ;
+    const auto add = "INSERT INTO " + _name + " VALUES(" + values("new.") + ");" ;
+
+    Transaction transaction(_db) ;
+    auto exists = query_int64(_db, "SELECT count(*) FROM sqlite_master WHERE"
+                                   " name = '" + _name + "';");
+    execute(_db, ("CREATE VIRTUAL TABLE IF NOT EXISTS " + _name
+                  + " USING rtree(id, " + boxes + ");").c_str());
+    execute(_db, (trigger + "_insert AFTER INSERT ON " + _table + " BEGIN "
+                  + add + " END;").c_str());
+    execute(_db, (trigger + "_delete AFTER DELETE ON " + _table + " BEGIN "
+                  + remove + " END;").c_str());
+    execute(_db, (trigger + "_update AFTER UPDATE OF " + _key + ", " + boxes
+                  + " ON " + _table + " BEGIN " + remove + add + " END;").c_str());
+    if (not exists)
+      execute(_db, ("INSERT INTO " + _name + " SELECT " + values("") + " FROM "
+                    + _table + ";").c_str());
+    transaction.commit() ;
+  }
+
+  // rows whose box lies completely inside b, columns of the table as t
+  void within_box(const box& b, stmt_callback callback,
+                  const std::string& columns = "t.*") {
+    auto cached = _within.find(columns) ;
+    if (cached == _within.end()) cached = _within.emplace(columns, create_statement(_db,
+        "SELECT " + columns + " FROM " + _name + " AS r JOIN " + _table
+        + " AS t ON t." + _key + " = r.id WHERE r.max_x >= @x0 AND r.min_x <= @x1"
+        " AND r.max_y >= @y0 AND r.min_y <= @y1 AND t." + _c.min_x + " >= @x0"
+        " AND t." + _c.max_x + " <= @x1 AND t." + _c.min_y + " >= @y0 AND t."
+        + _c.max_y + " <= @y1;")).first ;
+    bind_box(cached->second.get(), b);
+    run(cached->second.get(), callback);
+  }
+
+  // the k boxes closest to (x, y), by distance to the box, closest first
+  std::vector<std::pair<int64_t, double>> nearest(double x, double y,
+                                                  std::size_t k,
+                                                  double radius = 1) {
+    if (k == 0) return {} ;
+    if (not _around) _around = create_statement(_db,
+        "SELECT t." + _key + ", t." + _c.min_x + ", t." + _c.max_x + ", t."
+        + _c.min_y + ", t." + _c.max_y + " FROM " + _name + " AS r JOIN "
+        + _table + " AS t ON t." + _key + " = r.id WHERE r.max_x >= @x0 AND"
+        " r.min_x <= @x1 AND r.max_y >= @y0 AND r.min_y <= @y1;");
+    box all ;
+    bool any = extent(all) ;
+    std::vector<std::pair<int64_t, double>> found ;
+    // grow the search box until k boxes are closer than its radius,
+    // or it covers all of them
+    while (any) {
+      found.clear();
+      const box around{x - radius, x + radius, y - radius, y + radius} ;
+      bind_box(_around.get(), around);
+      run(_around.get(), [&](not_null<sqlite3_stmt*> row) {
+        auto dx = std::max({sqlite3_column_double(row, 1) - x, 0.0,
+                            x - sqlite3_column_double(row, 2)});
+        auto dy = std::max({sqlite3_column_double(row, 3) - y, 0.0,
+                            y - sqlite3_column_double(row, 4)});
+        found.emplace_back(sqlite3_column_int64(row, 0), std::hypot(dx, dy));
+        return true ;
+      });
+      std::sort(found.begin(), found.end(),
+                [](const std::pair<int64_t, double>& a,
+                   const std::pair<int64_t, double>& b) { return a.second < b.second; });
+      if ((found.size() >= k && found[k - 1].second <= radius)
+          || (around.min_x <= all.min_x && around.max_x >= all.max_x
+              && around.min_y <= all.min_y && around.max_y >= all.max_y)) break ;
+      radius *= 2 ;
+    }
+    if (found.size() > k) found.resize(k);
+    return found ;
+  }
+
+private:
+  // the box around all rows, false if there are none. read again only
+  // after a write on this connection or a commit on another one
+  bool extent(box& b) {
+    if (not _version) _version = create_statement(_db, "PRAGMA data_version;");
+    int64_t version = 0 ;
+    fetch_int64(_version.get(), version);
+    const auto changes = sqlite3_total_changes(_db);
+    if (not _extent_read || version != _extent_version || changes != _extent_changes) {
+      if (not _bounds) _bounds = create_statement(_db,
+          "SELECT min(" + _c.min_x + "), max(" + _c.max_x + "), min(" + _c.min_y
+          + "), max(" + _c.max_y + ") FROM " + _name + ";");
+      run(_bounds.get(), [&](not_null<sqlite3_stmt*> row) {
+        _any = sqlite3_column_type(row, 0) != SQLITE_NULL ;
+        _extent = box{sqlite3_column_double(row, 0), sqlite3_column_double(row, 1),
+                      sqlite3_column_double(row, 2), sqlite3_column_double(row, 3)} ;
+        return false ;
+      });
+      _extent_read = true ;
+      _extent_version = version ;
+      _extent_changes = changes ;
+    }
+    b = _extent ;
+    return _any ;
+  }
+
+  static void bind_box(not_null<sqlite3_stmt*> stmt, const box& b) {
+    parameter(stmt, 1, b.min_x) ;
+    parameter(stmt, 2, b.max_x) ;
+    parameter(stmt, 3, b.min_y) ;
+    parameter(stmt, 4, b.max_y) ;
+  }
+
+  sqlite3* _db ;
+  std::string _table ;
+  std::string _name ;
+  std::string _key ;
+  box_columns _c ;
+  std::unordered_map<std::string, statement> _within ;
+  statement _around{nullptr, sqlite3_finalize} ;
+  statement _version{nullptr, sqlite3_finalize} ;
+  statement _bounds{nullptr, sqlite3_finalize} ;
+  bool _extent_read = false ;
+  int64_t _extent_version = 0 ;
+  int _extent_changes = 0 ;
+  bool _any = false ;
+  box _extent{0, 0, 0, 0} ;
+};
+
+
+void main18()
+{
+  auto db = open_database(":memory:");
+  execute(db.get(), "CREATE TABLE things(id INTEGER PRIMARY KEY, name TEXT,value REAL,"
+                    " min_x REAL, max_x REAL, min_y REAL, max_y REAL);");
+  { Transaction transaction(db.get()) ;
+    auto add_thing = create_statement(db.get(),
+          "INSERT INTO things(name, value, min_x, max_x, min_y, max_y)"
+          " VALUES('thing', 0, @x0, @x1, @y0, @y1);");
+    uint32_t random = 42 ;
+    auto next = [&]() {
+      random = random * 1664525u + 1013904223u ;
+      return double(random >> 8) / (1 << 24) ;
+    };
+    for (int i = 0; i < 200000; ++i) {
+      auto x = next() * 1000, y = next() * 1000 ;
+      parameter(add_thing.get(), 1, x) ;
+      parameter(add_thing.get(), 2, x + next() * 2) ;
+      parameter(add_thing.get(), 3, y) ;
+      parameter(add_thing.get(), 4, y + next() * 2) ;
+      run(add_thing.get());
+    }
+    transaction.commit() ;
+  }
+  execute(db.get(), "CREATE INDEX things_box ON things(min_x, min_y);");
+  spatial_index boxes(db.get(), "things");
+
+  auto measure = [](std::function<void()> f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  };
+  auto between = create_statement(db.get(),
+        "SELECT id FROM things WHERE min_x BETWEEN @x0 AND @x1 AND max_x BETWEEN"
+        " @x0 AND @x1 AND min_y BETWEEN @y0 AND @y1 AND max_y BETWEEN @y0 AND @y1;");
+  int64_t found_between = 0, found_rtree = 0 ;
+  auto count_between = [&](not_null<sqlite3_stmt*>) { ++found_between ; return true ; };
+  auto count_rtree = [&](not_null<sqlite3_stmt*>) { ++found_rtree ; return true ; };
+  const int queries = 1000 ;
+  auto between_ms = measure([&]{
+    for (int i = 0; i < queries; ++i) {
+      double x = i % 100 * 9.5, y = i / 10 % 100 * 9.5 ;
+      parameter(between.get(), 1, x) ;
+      parameter(between.get(), 2, x + 20) ;
+      parameter(between.get(), 3, y) ;
+      parameter(between.get(), 4, y + 20) ;
+      run(between.get(), count_between);
+    }
+  });
+  auto rtree_ms = measure([&]{
+    for (int i = 0; i < queries; ++i) {
+      double x = i % 100 * 9.5, y = i / 10 % 100 * 9.5 ;
+      boxes.within_box(box{x, x + 20, y, y + 20}, count_rtree, "t.id");
+    }
+  });
+  std::cout << queries << " box queries: BETWEEN " << found_between << " in "
+            << between_ms << "ms, rtree " << found_rtree << " in " << rtree_ms
+            << "ms\nnearest to (500, 500):" ;
+  for (const auto& n : boxes.nearest(500, 500, 3))
+    std::cout << " " << n.first << " at " << n.second ;
+
+  // boxes that are not exact floats
+  execute(db.get(), "INSERT INTO things(id, name, min_x, max_x, min_y, max_y)"
+                    " VALUES(1000000, 'small', 0.1, 0.2, 0.1, 0.2);");
+  int64_t inside = 0 ;
+  boxes.within_box(box{0.1, 0.2, 0.1, 0.2}, [&](not_null<sqlite3_stmt*> row) {
+    inside += sqlite3_column_int64(row, 0) == 1000000 ;
+    return true ;
+  }, "t.id");
+  std::cout << "\nbox (0.1, 0.2, 0.1, 0.2) inside itself: " << inside << "\n" ;
+
+  // the search box stops growing once it covers all rows
+  auto far = measure([&]{
+    std::cout << "nearest to (1e6, 1e6):" ;
+    for (const auto& n : boxes.nearest(1e6, 1e6, 2))
+      std::cout << " " << n.first << " at " << n.second ;
+  });
+  std::cout << " in " << far << "ms, "
+            << boxes.nearest(500, 500, 0).size() << " for k = 0\n" ;
+}
+
+
+//
+// typed table description
+//
+// a constexpr list of column names and C++ types, the only place the
+// schema is written down. CREATE TABLE, INSERT, UPSERT and SELECT by key
+// are generated from it, and typed_table binds and fetches with exactly
+// those types, so a string for a REAL column does not compile.
+// the first column is the key.
+//
+struct column_info
+{
+  const char* name ;
+  const char* type ;
+  const char* constraint ;
+};
+
+template<typename T>
+struct column_of
+{
+  const char* name ;
+  const char* constraint ;
+};
+
+template<typename T>
+constexpr column_of<T> col(const char* name, const char* constraint = "")
+{
+  return column_of<T>{name, constraint} ;
+}
+
+template<typename... T>
+struct table_schema
+{
+  static_assert(sizeof...(T) > 0, "a table needs a column") ;
+  static constexpr std::size_t size = sizeof...(T) ;
+
+  const char* name ;
+  column_info columns[sizeof...(T)] ;
+};
+
+template<typename... T>
+constexpr table_schema<T...> schema(const char* name, column_of<T>... columns)
+{
+  return table_schema<T...>{
+    name, {column_info{columns.name, declared_type(static_cast<T*>(nullptr)),
+                       columns.constraint}...}
+  } ;
+}
+
+template<typename... T>
+std::string column_list(const table_schema<T...>& s, const char* prefix = "")
+{
+  std::string sql ;
+  for (std::size_t i = 0; i < s.size; ++i)
+    sql += (i ? ", " : "") + std::string(prefix) + s.columns[i].name ;
+  return sql ;
+}
+
+template<typename... T>
+std::string create_table_sql(const table_schema<T...>& s)
+{
+  std::string sql = "CREATE TABLE " + std::string(s.name) + "(" ;
+  for (std::size_t i = 0; i < s.size; ++i) {
+    const auto& c = s.columns[i] ;
+    sql += (i ? ", " : "") + std::string(c.name) + " " + c.type ;
+    if (*c.constraint) sql += std::string(" ") + c.constraint ;
+  }
+  return sql + ");" ;
+}
+
+template<typename... T>
+std::string insert_sql(const table_schema<T...>& s)
+{
+  std::string sql = "INSERT INTO " + std::string(s.name) + "("
+                  + column_list(s) + ") VALUES(" ;
+  for (std::size_t i = 0; i < s.size; ++i)
+    sql += (i ? ", ?" : "?") + std::to_string(i + 1) ;
+  return sql + ")" ;
+}
+
+template<typename... T>
+std::string upsert_sql(const table_schema<T...>& s)
+{
+  std::string sql = insert_sql(s) + " ON CONFLICT(" + s.columns[0].name + ")" ;
+  if (s.size == 1) return sql + " DO NOTHING;" ;
+  sql += " DO UPDATE SET " ;
+  for (std::size_t i = 1; i < s.size; ++i)
+    sql += (i > 1 ? ", " : "") + std::string(s.columns[i].name)
+         + " = excluded." + s.columns[i].name ;
+  return sql + ";" ;
+}
+
+template<typename... T>
+std::string select_by_key_sql(const table_schema<T...>& s)
+{
+  return "SELECT " + column_list(s) + " FROM " + s.name + " WHERE "
+       + s.columns[0].name + " = ?1;" ;
+}
+
+template<> std::string column_value<std::string>(sqlite3_stmt* stmt, int col) {
+  auto first = (const char*)sqlite3_column_text(stmt, col);
+  std::size_t s = sqlite3_column_bytes(stmt, col);
+  return s > 0 ? std::string(first, s) : std::string{};
+}
+
+// binds values to index, index + 1, ...
+inline void bind_values(sqlite3_stmt*, int) {}
+
+template<typename V, typename... Rest>
+void bind_values(sqlite3_stmt* stmt, int index, const V& v, const Rest&... rest)
+{
+  parameter(stmt, index, v) ;
+  bind_values(stmt, index + 1, rest...);
+}
+
+template<typename... T>
+class typed_table
+{
+public:
+  using key_type = typename std::tuple_element<0, std::tuple<T...>>::type ;
+  using row = std::tuple<T...> ;
+
+  typed_table(not_null<sqlite3*> db, const table_schema<T...>& schema)
+  : _db{db}, _schema(schema)
+  {
+  }
+
+  void create() {
+    execute(_db, create_table_sql(_schema).c_str());
+  }
+
+  void insert(const T&... values) {
+    prepare(_insert, [this]{ return insert_sql(_schema) + ";" ; });
+    bind_values(_insert.get(), 1, values...);
+    run(_insert.get());
+  }
+
+  void upsert(const T&... values) {
+    prepare(_upsert, [this]{ return upsert_sql(_schema) ; });
+    bind_values(_upsert.get(), 1, values...);
+    run(_upsert.get());
+  }
+
+  bool fetch(const key_type& key, row& result) {
+    prepare(_select, [this]{ return select_by_key_sql(_schema) ; });
+    bind_values(_select.get(), 1, key);
+    bool found = false ;
+    run(_select.get(), [&](not_null<sqlite3_stmt*> stmt) {
+      result = decode(stmt, typename make_indices<sizeof...(T)>::type{});
+      found = true ;
+      return false ;
+    });
+    return found ;
+  }
+
+private:
+  // statements are prepared on first use, the table may not exist before
+  template<typename Make>
+  void prepare(statement& stmt, Make make) {
+    if (not stmt) stmt = create_statement(_db, make());
+  }
+
+  template<std::size_t... I>
+  static row decode(sqlite3_stmt* stmt, indices<I...>) {
+    return row(column_value<T>(stmt, I)...) ;
+  }
+
+  sqlite3* _db ;
+  table_schema<T...> _schema ;
+  statement _insert{nullptr, sqlite3_finalize} ;
+  statement _upsert{nullptr, sqlite3_finalize} ;
+  statement _select{nullptr, sqlite3_finalize} ;
+};
+
+template<typename... T>
+typed_table<T...> make_table(not_null<sqlite3*> db, const table_schema<T...>& schema)
+{
+  return typed_table<T...>(db, schema) ;
+}
+
+constexpr auto things_schema = schema("things",
+                                      col<int64_t>("id", "PRIMARY KEY"),
+                                      col<std::string>("name"),
+                                      col<double>("value"));
+
+
+void main19()
+{
+  auto db = open_database(":memory:");
+  auto things = make_table(db.get(), things_schema);
+  std::cout << create_table_sql(things_schema) << "\n"
+            << upsert_sql(things_schema) << "\n"
+            << select_by_key_sql(things_schema) << "\n" ;
+  things.create();
+  { Transaction transaction(db.get()) ;
+    things.insert(0, "", 0.0) ;
+    things.insert(1, "first", 1.1) ;
+    // things.insert(1, "first", "second") ; // does not compile
+    things.upsert(1, "first again", 1.2) ;
+    things.upsert(2, "second", 2.2) ;
+    transaction.commit() ;
+  }
+  decltype(things)::row thing ;
+  for (int64_t id : {1, 2, 3}) {
+    if (things.fetch(id, thing))
+      std::cout << std::get<0>(thing) << ", " << std::get<1>(thing) << ", "
+                << std::get<2>(thing) << "\n" ;
+    else
+      std::cout << id << " not found\n" ;
+  }
+  std::cout << "values stored with an other type: "
+            << query_int64(db.get(), "SELECT count(*) FROM things"
+                                     " WHERE typeof(value) <> 'real';") << "\n" ;
+}
+
+
+//
+// parameter count checked at compile time
+//
+// sql_text::parameter_count counts the parameters of an SQL literal the
+// way sqlite3_bind_parameter_count does: ? takes the next index, ?NNN
+// sets it, :name @name $name take the next index unless the same name was
+// used before. strings, quoted names and comments are skipped.
+//   auto add = TYPED_SQL(db, "INSERT INTO things VALUES(@id,@name,@value);",
+//                        int64_t, std::string, double);
+//   add.bind(1, "first", 1.1).run();
+// does not compile when the types and the placeholders do not match.
+// constexpr recursion goes per token, very long statements may need a
+// bigger -fconstexpr-depth.
+//
+namespace sql_text
+{
+constexpr bool digit(char c) { return c >= '0' && c <= '9' ; }
+
+constexpr bool ident(char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || digit(c)
+      || c == '_' || c == '$' || static_cast<unsigned char>(c) >= 0x80 ;
+}
+
+constexpr bool named(const char* s, std::size_t i)
+{
+  return (s[i] == ':' || s[i] == '@' || s[i] == '$') && ident(s[i + 1]) ;
+}
+
+constexpr bool special(const char* s, std::size_t i)
+{
+  return !s[i] || s[i] == '?' || named(s, i) || ident(s[i])
+      || s[i] == '\'' || s[i] == '"' || s[i] == '`' || s[i] == '['
+      || (s[i] == '-' && s[i + 1] == '-') || (s[i] == '/' && s[i + 1] == '*') ;
+}
+
+constexpr std::size_t plain_end(const char* s, std::size_t i)
+{
+  return special(s, i) ? i : plain_end(s, i + 1) ;
+}
+
+constexpr std::size_t ident_end(const char* s, std::size_t i)
+{
+  return ident(s[i]) ? ident_end(s, i + 1) : i ;
+}
+
+constexpr std::size_t digits_end(const char* s, std::size_t i)
+{
+  return digit(s[i]) ? digits_end(s, i + 1) : i ;
+}
+
+// i is after the opening quote, a doubled close quote is part of the text
+constexpr std::size_t quoted_end(const char* s, std::size_t i, char close)
+{
+  return !s[i] ? i
+       : s[i] != close ? quoted_end(s, i + 1, close)
+       : s[i + 1] == close && close != ']' ? quoted_end(s, i + 2, close)
+       : i + 1 ;
+}
+
+constexpr std::size_t line_end(const char* s, std::size_t i)
+{
+  return !s[i] || s[i] == '\n' ? i : line_end(s, i + 1) ;
+}
+
+constexpr std::size_t comment_end(const char* s, std::size_t i)
+{
+  return !s[i] ? i : s[i] == '*' && s[i + 1] == '/' ? i + 2 : comment_end(s, i + 1) ;
+}
+
+constexpr bool placeholder(const char* s, std::size_t i)
+{
+  return s[i] == '?' || named(s, i) ;
+}
+
+constexpr std::size_t placeholder_end(const char* s, std::size_t i)
+{
+  return s[i] == '?' ? digits_end(s, i + 1) : ident_end(s, i + 1) ;
+}
+
+// start of the next placeholder at or after i, or the end of s
+constexpr std::size_t next_placeholder(const char* s, std::size_t i)
+{
+  return !s[i] || placeholder(s, i) ? i
+       : ident(s[i]) ? next_placeholder(s, ident_end(s, i))
+       : s[i] == '\'' || s[i] == '"' || s[i] == '`'
+           ? next_placeholder(s, quoted_end(s, i + 1, s[i]))
+       : s[i] == '[' ? next_placeholder(s, quoted_end(s, i + 1, ']'))
+       : s[i] == '-' && s[i + 1] == '-' ? next_placeholder(s, line_end(s, i))
+       : s[i] == '/' && s[i + 1] == '*' ? next_placeholder(s, comment_end(s, i + 2))
+       : next_placeholder(s, plain_end(s, i + 1)) ;
+}
+
+constexpr bool same(const char* s, std::size_t a, std::size_t b, std::size_t n)
+{
+  return n == 0 || (s[a] == s[b] && same(s, a + 1, b + 1, n - 1)) ;
+}
+
+// is the placeholder [b, e) used before b, looking from placeholder p on
+constexpr bool seen(const char* s, std::size_t p, std::size_t b, std::size_t e)
+{
+  return p >= b ? false
+       : placeholder_end(s, p) - p == e - b && same(s, p, b, e - b) ? true
+       : seen(s, next_placeholder(s, placeholder_end(s, p)), b, e) ;
+}
+
+constexpr int number(const char* s, std::size_t b, std::size_t e, int n = 0)
+{
+  return b == e ? n : number(s, b + 1, e, n * 10 + (s[b] - '0')) ;
+}
+
+// highest index after the placeholder at p, n before it
+constexpr int index_after(const char* s, std::size_t p, int n)
+{
+  return s[p] != '?'
+           ? (seen(s, next_placeholder(s, 0), p, placeholder_end(s, p)) ? n : n + 1)
+       : !digit(s[p + 1]) ? n + 1
+       : number(s, p + 1, placeholder_end(s, p)) > n
+           ? number(s, p + 1, placeholder_end(s, p)) : n ;
+}
+
+constexpr int count_from(const char* s, std::size_t p, int n)
+{
+  return !s[p] ? n
+       : count_from(s, next_placeholder(s, placeholder_end(s, p)), index_after(s, p, n)) ;
+}
+
+constexpr int parameter_count(const char* s)
+{
+  return count_from(s, next_placeholder(s, 0), 0) ;
+}
+}
+
+template<typename... T>
+class typed_statement
+{
+public:
+  explicit typed_statement(statement stmt) : _stmt(std::move(stmt)) {}
+
+  // the count is known to match, bind without asking sqlite for it
+  typed_statement& bind(const T&... values) {
+    bind_values(_stmt.get(), 1, values...);
+    return *this ;
+  }
+
+  void run(stmt_callback callback = stmt_callback{}) {
+    ::run(_stmt.get(), callback);
+  }
+
+  sqlite3_stmt* get() const { return _stmt.get() ; }
+
+private:
+  statement _stmt ;
+};
+
+template<int Count, typename... T>
+typed_statement<T...> prepare_typed(not_null<sqlite3*> db, const char* sql)
+{
+  static_assert(Count == sizeof...(T),
+                "the number of types does not match the SQL parameters") ;
+  return typed_statement<T...>(create_statement(db, sql)) ;
+}
+
+// for statements with parameters, without any use create_statement
+#define TYPED_SQL(db, sql, ...) \
+  prepare_typed<sql_text::parameter_count(sql), __VA_ARGS__>(db, sql)
+
+
+void main20()
+{
+  auto db = open_database(":memory:");
+  execute(db.get(), create_table_sql(things_schema).c_str());
+
+  auto add_thing = TYPED_SQL(db.get(),
+        "INSERT INTO things VALUES(@id,@name,@value);",
+        int64_t, std::string, double);
+  // TYPED_SQL(db.get(), "INSERT INTO things VALUES(@id,@name,@value);",
+  //           int64_t, std::string); // does not compile
+  { Transaction transaction(db.get()) ;
+    add_thing.bind(1, "first", 1.1).run();
+    add_thing.bind(2, "second", 2.2).run();
+    transaction.commit() ;
+  }
+  auto by_name = TYPED_SQL(db.get(),
+        "SELECT * FROM things WHERE name = :name OR name = ?3 -- or :other\n"
+        " OR name = ':quoted' OR id = :name;",
+        std::string, std::string, std::string);
+  by_name.bind("first", "unused", "second").run(print_thing);
+
+  constexpr const char* tricky =
+      "SELECT ? AS \"@col\", '?' AS [:x] /* :c */, ?5, $a, @a, @a, ? ;" ;
+  static_assert(sql_text::parameter_count(tricky) == 8, "miscounted") ;
+  auto stmt = create_statement(db.get(), tricky);
+  std::cout << "parameters: " << sql_text::parameter_count(tricky)
+            << ", sqlite says " << sqlite3_bind_parameter_count(stmt.get()) << "\n" ;
+}
+
+
+//
+// generated row structs
+//
+// things_rows.h is generated by make from things.sql (see schemagen.cpp),
+// a struct per table and decoders that read every column once, by index,
+// as owned values or as text_view into the current row.
+//
+#include "things_rows.h"
+
+
+void main21()
+{
+  auto db = open_database(":memory:");
+  execute(db.get(), things_create);
+  execute(db.get(), "INSERT INTO things VALUES(1, 'one', 1.1), (2, 'two', 2.2),"
+                    " (3, NULL, NULL);");
+  auto stmt = create_statement(db.get(), std::string(things_select) + " ORDER BY id;");
+  std::vector<things_row> rows ;
+  run(stmt.get(), [&](not_null<sqlite3_stmt*> row) {
+    rows.push_back(decode_things_row(row));
+    return true ;
+  });
+  for (const auto& thing : rows)
+    std::cout << thing.id << ", '" << thing.name << "', " << thing.value << "\n" ;
+  std::size_t names = 0 ;
+  run(stmt.get(), [&](not_null<sqlite3_stmt*> row) {
+    names += decode_things_row_view(row).name.size ;
+    return true ;
+  });
+  std::cout << "name bytes without a copy: " << names << "\n" ;
+}
+
+
+//
+// columns by name
+//
+// column_index sorts the column names of a statement once, lookups are a
+// binary search instead of a loop over sqlite3_column_name per row.
+// when sqlite prepares the statement again, after a schema change, the
+// columns of SELECT * can change, refresh notices that and rebuilds.
+// a column_name remembers the index it resolved to, so constant names
+// are looked up once per prepare and after that cost one compare.
+// with duplicate names the first column wins.
+//
+struct column_name
+{
+  explicit column_name(const char* n) : name{n} {}
+
+  const char* name ;
+  int index = -1 ;
+  unsigned generation = 0 ;
+};
+
+class column_index
+{
+public:
+  explicit column_index(not_null<sqlite3_stmt*> stmt) : _stmt{stmt} { build(); }
+
+  // true if the statement was prepared again and the index rebuilt
+  bool refresh() {
+    if (reprepared() == _reprepared) return false ;
+    build();
+    return true ;
+  }
+
+  // -1 if there is no such column
+  int find(const char* name) const {
+    auto it = std::lower_bound(_names.begin(), _names.end(), name,
+        [](const std::pair<const char*, int>& e, const char* n) {
+          return std::strcmp(e.first, n) < 0 ;
+        });
+    return it != _names.end() && std::strcmp(it->first, name) == 0 ? it->second : -1 ;
+  }
+
+  int find(const std::string& name) const { return find(name.c_str()); }
+
+  int find(column_name& column) const {
+    if (column.generation != _generation) {
+      column.index = find(column.name);
+      column.generation = _generation ;
+    }
+    return column.index ;
+  }
+
+  std::size_t size() const { return _names.size() ; }
+
+private:
+  int reprepared() const {
+    return sqlite3_stmt_status(_stmt, SQLITE_STMTSTATUS_REPREPARE, 0) ;
+  }
+
+  void build() {
+    static std::atomic<unsigned> generations{0} ;
+    _reprepared = reprepared() ;
+    _generation = ++generations ;
+    _storage.clear();
+    const int count = sqlite3_column_count(_stmt) ;
+    for (int i = 0; i < count; ++i) _storage.push_back(sqlite3_column_name(_stmt, i));
+    _names.clear();
+    for (int i = 0; i < count; ++i) _names.emplace_back(_storage[i].c_str(), i);
+    std::stable_sort(_names.begin(), _names.end(),
+        [](const std::pair<const char*, int>& a, const std::pair<const char*, int>& b) {
+          return std::strcmp(a.first, b.first) < 0 ;
+        });
+  }
+
+  sqlite3_stmt* _stmt ;
+  int _reprepared = 0 ;
+  unsigned _generation = 0 ;
+  // sqlite's name pointers die with a reprepare, keep own copies
+  std::vector<std::string> _storage ;
+  std::vector<std::pair<const char*, int>> _names ;
+};
+
+// the current row of a statement, columns by name, an unknown name throws
+struct named_row
+{
+  sqlite3_stmt* stmt ;
+  const column_index& columns ;
+
+  template<typename Name>
+  int64_t int64(Name&& name) const {
+    return sqlite3_column_int64(stmt, index(name));
+  }
+  template<typename Name>
+  double real(Name&& name) const {
+    return sqlite3_column_double(stmt, index(name));
+  }
+  template<typename Name>
+  text_view text(Name&& name) const {
+    const int i = index(name) ;
+    auto first = (const char*)sqlite3_column_text(stmt, i);
+    return text_view{first, std::size_t(sqlite3_column_bytes(stmt, i))} ;
+  }
+
+private:
+  static const char* name_of(const char* name) { return name ; }
+  static const char* name_of(const std::string& name) { return name.c_str() ; }
+  static const char* name_of(const column_name& name) { return name.name ; }
+
+  template<typename Name>
+  int index(Name& name) const {
+    const int i = columns.find(name) ;
+    if (i < 0) throw std::out_of_range(std::string("no column ") + name_of(name)) ;
+    return i ;
+  }
+};
+
+using named_callback = std::function<bool(const named_row&)> ;
+
+void run(not_null<sqlite3_stmt*> stmt, column_index& columns, named_callback callback)
+{
+  bool checked = false ;
+  run(stmt, [&](not_null<sqlite3_stmt*> row) {
+    // a reprepare happens in the first step
+    if (not checked) {
+      columns.refresh();
+      checked = true ;
+    }
+    return callback(named_row{row, columns});
+  });
+}
+
+
+void main22()
+{
+  auto db = open_database(":memory:");
+  std::string create = "CREATE TABLE wide(id INTEGER PRIMARY KEY" ;
+  for (int i = 1; i < 32; ++i) create += ", c" + std::to_string(i) + " INTEGER" ;
+  execute(db.get(), (create + ");").c_str());
+  { Transaction transaction(db.get()) ;
+    auto add = create_statement(db.get(),
+          "INSERT INTO wide(id, c7, c31) VALUES(?1, ?1 * 7, ?1 * 31);");
+    for (int64_t i = 0; i < 200000; ++i) {
+      parameter(add.get(), 1, i);
+      run(add.get());
+    }
+    transaction.commit() ;
+  }
+  auto stmt = create_statement(db.get(), "SELECT * FROM wide;");
+
+  auto measure = [](std::function<void()> f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  };
+  int64_t scanned = 0, indexed = 0 ;
+  auto scan_ms = measure([&]{
+    run(stmt.get(), [&](not_null<sqlite3_stmt*> row) {
+      for (const char* name : {"c7", "c31"})
+        for (int i = 0; i < sqlite3_column_count(row); ++i)
+          if (std::strcmp(sqlite3_column_name(row, i), name) == 0)
+            scanned += sqlite3_column_int64(row, i) ;
+      return true ;
+    });
+  });
+  column_index columns(stmt.get());
+  column_name c7{"c7"}, c31{"c31"} ;
+  auto index_ms = measure([&]{
+    run(stmt.get(), columns, [&](const named_row& row) {
+      indexed += row.int64(c7) + row.int64(c31) ;
+      return true ;
+    });
+  });
+  std::cout << "by name, scanning names " << scanned << " in " << scan_ms
+            << "ms, column_index " << indexed << " in " << index_ms << "ms\n" ;
+
+  // the statement is prepared again and sees the new column order
+  execute(db.get(), "DROP TABLE wide; CREATE TABLE wide(c31 INTEGER, c7 INTEGER);"
+                    " INSERT INTO wide VALUES(31, 7);");
+  run(stmt.get(), columns, [&](const named_row& row) {
+    std::cout << "after the schema change " << columns.size() << " columns, c7 = "
+              << row.int64(c7) << " at " << columns.find(c7) << ", c31 = "
+              << row.int64("c31") << "\n" ;
+    try {
+      row.int64("c13");
+    }
+    catch (const std::out_of_range& e) {
+      std::cout << "misspelled: " << e.what() << "\n" ;
+    }
+    return true ;
+  });
+}
+
+
+//
+// row dumper with cached column metadata
+//
+// prints rows like dump_current_row, but takes the column count and names
+// once per prepare. the type of a cell is still asked for every cell: a
+// declared type, even STRICT and NOT NULL, does not bind what a LEFT JOIN
+// or a compound SELECT puts into the column. the type picks a decoder
+// from a table instead of an if chain, text is written without a copy.
+//
+class row_dumper
+{
+public:
+  using decoder = void (*)(std::ostream&, sqlite3_stmt*, int) ;
+
+  explicit row_dumper(not_null<sqlite3_stmt*> stmt, std::ostream& out = std::cout)
+  : _stmt{stmt}, _out(out)
+  {
+    build();
+  }
+
+  bool operator()(not_null<sqlite3_stmt*> stmt) {
+    if (sqlite3_stmt_status(_stmt, SQLITE_STMTSTATUS_REPREPARE, 0) != _reprepared)
+      build();
+    static const decoder by_type[] = {nullptr, integer, real, text, blob, null} ;
+    for (int i = 0; i < _count; ++i) {
+      by_type[sqlite3_column_type(stmt, i)](_out, stmt, i);
+      _out.put('|');
+    }
+    _out.put('\n');
+    return true ;
+  }
+
+  const std::vector<std::string>& names() const { return _names ; }
+
+private:
+  static void null(std::ostream& out, sqlite3_stmt*, int) { out << "<NULL>" ; }
+  static void integer(std::ostream& out, sqlite3_stmt* stmt, int i) {
+    out << sqlite3_column_int64(stmt, i) ;
+  }
+  static void real(std::ostream& out, sqlite3_stmt* stmt, int i) {
+    out << sqlite3_column_double(stmt, i) ;
+  }
+  static void text(std::ostream& out, sqlite3_stmt* stmt, int i) {
+    auto first = (const char*)sqlite3_column_text(stmt, i);
+    out.put('\'');
+    out.write(first, sqlite3_column_bytes(stmt, i));
+    out.put('\'');
+  }
+  static void blob(std::ostream& out, sqlite3_stmt*, int) { out << "<BLO000B>" ; }
+
+  void build() {
+    _reprepared = sqlite3_stmt_status(_stmt, SQLITE_STMTSTATUS_REPREPARE, 0) ;
+    _count = sqlite3_column_count(_stmt) ;
+    _names.clear();
+    for (int i = 0; i < _count; ++i) _names.push_back(sqlite3_column_name(_stmt, i));
+  }
+
+  sqlite3_stmt* _stmt ;
+  std::ostream& _out ;
+  int _reprepared = 0 ;
+  int _count = 0 ;
+  std::vector<std::string> _names ;
+};
+
+
+void main23()
+{
+  auto db = open_database(":memory:");
+  std::string create = "CREATE TABLE wide(id INTEGER PRIMARY KEY" ;
+  for (int i = 1; i < 32; ++i)
+    create += ", c" + std::to_string(i) + (i % 2 ? " INTEGER" : " TEXT")
+            + " NOT NULL DEFAULT " + (i % 2 ? "0" : "''") ;
+  execute(db.get(), (create + ") STRICT;").c_str());
+  { Transaction transaction(db.get()) ;
+    auto add = create_statement(db.get(),
+          "INSERT INTO wide(id, c1, c2, c31) VALUES(?1, ?1 * 7, 'x' || ?1, ?1 * 31);");
+    for (int64_t i = 0; i < 50000; ++i) {
+      parameter(add.get(), 1, i);
+      run(add.get());
+    }
+    transaction.commit() ;
+  }
+
+  auto measure = [](std::function<void()> f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  };
+  // both into a string, same output or not
+  auto compare = [&](const std::string& sql, bool timed) {
+    auto stmt = create_statement(db.get(), sql);
+    std::ostringstream generic, cached ;
+    auto old = std::cout.rdbuf(generic.rdbuf()) ;
+    auto generic_ms = measure([&]{ run(stmt.get(), dump_current_row); });
+    std::cout.rdbuf(old) ;
+    row_dumper dump(stmt.get(), cached) ;
+    auto cached_ms = measure([&]{ run(stmt.get(), std::ref(dump)); });
+    std::cout << (sql.size() > 40 ? sql.substr(0, 40) + "..." : sql) << ": " ;
+    if (timed)
+      std::cout << dump.names().size() << " columns, dump_current_row "
+                << generic_ms << "ms, row_dumper " << cached_ms << "ms, " ;
+    std::cout << "same output " << std::boolalpha
+              << (generic.str() == cached.str()) << "\n" ;
+  };
+  compare("SELECT *, c1 * 2 FROM wide;", true);
+  compare("SELECT a.c1, b.c2 FROM wide a LEFT JOIN wide b ON b.id = a.id + 49990"
+          " WHERE a.id > 49980;", false);
+  compare("SELECT c1 FROM wide WHERE id < 3 UNION ALL SELECT 'text';", false);
+}
+
+
+//
+// lazy row proxy
+//
+// callbacks get the row as a row_proxy, a column is decoded on first
+// access and the value kept until the next step, text as a text_view
+// into the row, so it does not allocate.
+// a slot remembers the step it was decoded in, a new row costs nothing
+// for columns no one reads. asking for another type decodes again.
+//
+class row_proxy
+{
+public:
+  explicit row_proxy(not_null<sqlite3_stmt*> stmt)
+  : _stmt{stmt}
+  , _slots(sqlite3_column_count(stmt))
+  {
+  }
+
+  template<typename T>
+  T get(int i) {
+    auto& s = _slots[i] ;
+    if (s.step != _step || s.kind != kind(static_cast<T*>(nullptr))) {
+      decode(i, s, static_cast<T*>(nullptr));
+      s.step = _step ;
+      s.kind = kind(static_cast<T*>(nullptr)) ;
+    }
+    return value(s, static_cast<T*>(nullptr)) ;
+  }
+
+  bool is_null(int i) { return sqlite3_column_type(_stmt, i) == SQLITE_NULL ; }
+  int size() const { return int(_slots.size()) ; }
+  sqlite3_stmt* stmt() const { return _stmt ; }
+
+  // called before a row is handed out
+  void next() {
+    if (++_step == 0) for (auto& s : _slots) s.step = 0 ;
+    // a reprepare can change the columns
+    if (_slots.size() != std::size_t(sqlite3_column_count(_stmt)))
+      _slots.assign(sqlite3_column_count(_stmt), slot{});
+  }
+
+private:
+  enum { none, integer, real, text } ;
+
+  struct slot
+  {
+    uint64_t step = 0 ;
+    int kind = none ;
+    union {
+      int64_t i ;
+      double d ;
+      text_view t ;
+    } ;
+    slot() : i{0} {}
+  };
+
+  static int kind(int64_t*) { return integer ; }
+  static int kind(double*) { return real ; }
+  static int kind(text_view*) { return text ; }
+
+  void decode(int i, slot& s, int64_t*) { s.i = sqlite3_column_int64(_stmt, i) ; }
+  void decode(int i, slot& s, double*) { s.d = sqlite3_column_double(_stmt, i) ; }
+  void decode(int i, slot& s, text_view*) {
+    auto first = (const char*)sqlite3_column_text(_stmt, i) ;
+    s.t = text_view{first ? first : "", std::size_t(sqlite3_column_bytes(_stmt, i))} ;
+  }
+
+  static int64_t value(const slot& s, int64_t*) { return s.i ; }
+  static double value(const slot& s, double*) { return s.d ; }
+  static text_view value(const slot& s, text_view*) { return s.t ; }
+
+  sqlite3_stmt* _stmt ;
+  uint64_t _step = 1 ;
+  std::vector<slot> _slots ;
+};
+
+// owned text is a copy of the view
+template<>
+inline std::string row_proxy::get<std::string>(int i) { return get<text_view>(i).str() ; }
+
+using proxy_callback = std::function<bool(row_proxy&)> ;
+
+void run(not_null<sqlite3_stmt*> stmt, proxy_callback callback)
+{
+  row_proxy row(stmt) ;
+  run(stmt, [&](not_null<sqlite3_stmt*>) {
+    row.next();
+    return callback(row);
+  });
+}
+
+
+void main24()
+{
+  auto db = open_database(":memory:");
+  std::string create = "CREATE TABLE wide(id INTEGER PRIMARY KEY, name TEXT" ;
+  for (int i = 2; i < 32; ++i) create += ", c" + std::to_string(i) + " TEXT" ;
+  execute(db.get(), (create + ");").c_str());
+  { Transaction transaction(db.get()) ;
+    auto add = create_statement(db.get(),
+          "INSERT INTO wide(id, name, c2, c31) VALUES(?1, 'a longer name ' || ?1,"
+          " 'x', 'y');");
+    for (int64_t i = 0; i < 200000; ++i) {
+      parameter(add.get(), 1, i);
+      run(add.get());
+    }
+    transaction.commit() ;
+  }
+  auto stmt = create_statement(db.get(), "SELECT * FROM wide;");
+
+  auto measure = [](std::function<void()> f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  };
+  // a callback that looks at id and name a few times, like print_thing
+  std::size_t eager = 0, lazy = 0 ;
+  auto eager_ms = measure([&]{
+    run(stmt.get(), [&](not_null<sqlite3_stmt*> row) {
+      auto id = [&](){ return sqlite3_column_int64(row, 0); } ;
+      auto name = [&](){ auto first = sqlite3_column_text(row, 1);
+        std::size_t s = sqlite3_column_bytes(row, 1);
+        return s > 0 ? std::string((const char*)first, s) : std::string{} ;
+      };
+      if (id() % 2 == 0 && not name().empty()) eager += name().size() + id() % 7 ;
+      return true ;
+    });
+  });
+  auto lazy_ms = measure([&]{
+    run(stmt.get(), [&](row_proxy& row) {
+      if (row.get<int64_t>(0) % 2 == 0 && row.get<text_view>(1).size > 0)
+        lazy += row.get<text_view>(1).size + row.get<int64_t>(0) % 7 ;
+      return true ;
+    });
+  });
+  std::cout << "2 of 32 columns: column lambdas " << eager << " in " << eager_ms
+            << "ms, row_proxy " << lazy << " in " << lazy_ms << "ms\n" ;
+}
+
+
+//
+// projection pushdown
+//
+// a row type lists the columns it reads, projected_query selects just
+// those, in that order, instead of SELECT *. sqlite then neither decodes
+// nor copies the other columns, and an index that holds all of them can
+// answer the query without the table.
+//   struct thing_name {
+//     int64_t id ; std::string name ;
+//     static projection<thing_name> columns() {
+//       return { read("id", &thing_name::id), read("name", &thing_name::name) } ;
+//     }
+//   };
+//
+template<typename Row>
+struct projected_column
+{
+  std::string name ;
+  std::function<void(Row&, sqlite3_stmt*, int)> decode ;
+};
+
+template<typename Row>
+using projection = std::vector<projected_column<Row>> ;
+
+template<typename Row, typename T>
+projected_column<Row> read(const std::string& name, T Row::* member)
+{
+  return projected_column<Row>{
+    name,
+    [member](Row& row, sqlite3_stmt* stmt, int i) { row.*member = column_value<T>(stmt, i) ; }
+  } ;
+}
+
+template<typename Row>
+class projected_query
+{
+public:
+  // SELECT <Row's columns> FROM from rest, rest can bind parameters
+  projected_query(not_null<sqlite3*> db, const std::string& from,
+                  const std::string& rest = "")
+  : _columns(Row::columns())
+  , _sql{select(_columns, from, rest)}
+  , _stmt{create_statement(db, _sql)}
+  {
+  }
+
+  const std::string& sql() const { return _sql ; }
+  sqlite3_stmt* get() const { return _stmt.get() ; }
+
+  void run(std::function<bool(const Row&)> callback) {
+    Row row ;
+    ::run(_stmt.get(), [&](not_null<sqlite3_stmt*> stmt) {
+      for (std::size_t i = 0; i < _columns.size(); ++i)
+        _columns[i].decode(row, stmt, int(i));
+      return callback(row);
+    });
+  }
+
+  std::vector<Row> fetch() {
+    std::vector<Row> rows ;
+    run([&](const Row& row) { rows.push_back(row); return true ; });
+    return rows ;
+  }
+
+private:
+  static std::string select(const projection<Row>& columns,
+                            const std::string& from, const std::string& rest) {
+    std::string sql = "SELECT " ;
+    for (std::size_t i = 0; i < columns.size(); ++i)
+      sql += (i ? ", \"" : "\"") + columns[i].name + "\"" ;
+    return sql + " FROM " + from + (rest.empty() ? "" : " " + rest) + ";" ;
+  }
+
+  projection<Row> _columns ;
+  std::string _sql ;
+  statement _stmt ;
+};
+
+struct thing_name
+{
+  int64_t id ;
+  std::string name ;
+
+  static projection<thing_name> columns() {
+    return { read("id", &thing_name::id), read("name", &thing_name::name) } ;
+  }
+};
+
+
+void main25()
+{
+  auto db = open_database(":memory:");
+  std::string create = "CREATE TABLE wide(id INTEGER PRIMARY KEY, name TEXT" ;
+  for (int i = 2; i < 32; ++i) create += ", c" + std::to_string(i) + " TEXT" ;
+  execute(db.get(), (create + ");").c_str());
+  { Transaction transaction(db.get()) ;
+    std::string columns = "id, name", values = "?1, 'name ' || ?1" ;
+    for (int i = 2; i < 32; ++i) {
+      columns += ", c" + std::to_string(i) ;
+      values += ", 'column " + std::to_string(i) + "'" ;
+    }
+    auto add = create_statement(db.get(),
+          "INSERT INTO wide(" + columns + ") VALUES(" + values + ");");
+    for (int64_t i = 0; i < 200000; ++i) {
+      parameter(add.get(), 1, i);
+      run(add.get());
+    }
+    transaction.commit() ;
+  }
+  execute(db.get(), "CREATE INDEX wide_name ON wide(name);");
+
+  auto measure = [](std::function<void()> f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  };
+  const std::string rest = "WHERE name >= 'name 5'" ;
+  auto everything = create_statement(db.get(), "SELECT * FROM wide " + rest + ";");
+  projected_query<thing_name> names(db.get(), "wide", rest);
+
+  for (const auto& sql : {"SELECT * FROM wide " + rest + ";", names.sql()}) {
+    std::cout << sql << "\n" ;
+    auto plan = create_statement(db.get(), "EXPLAIN QUERY PLAN " + sql);
+    run(plan.get(), dump_query_plan);
+  }
+  std::size_t star = 0, projected = 0 ;
+  auto star_ms = measure([&]{
+    thing_name row ;
+    run(everything.get(), [&](not_null<sqlite3_stmt*> stmt) {
+      row.id = column_value<int64_t>(stmt, 0) ;
+      row.name = column_value<std::string>(stmt, 1) ;
+      star += row.name.size() ;
+      return true ;
+    });
+  });
+  auto projected_ms = measure([&]{
+    names.run([&](const thing_name& row) { projected += row.name.size() ; return true ; });
+  });
+  std::cout << "SELECT * " << star << " in " << star_ms << "ms, projected "
+            << projected << " in " << projected_ms << "ms\n" ;
+}
+
+
+//
+// keyset pagination
+//
+// instead of LIMIT/OFFSET, which steps over all skipped rows, a page
+// starts after the keys of the last row of the previous page:
+//   SELECT ... WHERE (k1, k2) > (?, ?) ORDER BY k1, k2 LIMIT ?
+// with an index on the keys every page costs the same.
+// the keys must be NOT NULL and together unique, ascending only.
+// the cursor token is the last keys, a tag and a varint or the bytes per
+// key, base64url encoded. one statement per query shape is cached.
+//
+struct cursor_value
+{
+  int type ;
+  int64_t integer ;
+  double real ;
+  std::string text ;
+};
+
+namespace cursor_token
+{
+const char* const alphabet =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_" ;
+
+inline void varint(std::string& out, uint64_t v)
+{
+  for (; v >= 0x80; v >>= 7) out += char((v & 0x7f) | 0x80) ;
+  out += char(v) ;
+}
+
+inline uint64_t varint(const std::string& in, std::size_t& pos)
+{
+  uint64_t v = 0 ;
+  for (int shift = 0; pos < in.size() && shift < 64; shift += 7) {
+    auto byte = static_cast<unsigned char>(in[pos++]) ;
+    v |= uint64_t(byte & 0x7f) << shift ;
+    if (byte < 0x80) return v ;
+  }
+  throw std::invalid_argument("bad cursor token") ;
+}
+
+inline std::string base64(const std::string& in)
+{
+  std::string out ;
+  uint32_t bits = 0 ;
+  int count = 0 ;
+  for (unsigned char c : in) {
+    bits = bits << 8 | c ;
+    for (count += 8; count >= 6; count -= 6) out += alphabet[bits >> (count - 6) & 63] ;
+  }
+  if (count) out += alphabet[bits << (6 - count) & 63] ;
+  return out ;
+}
+
+inline std::string unbase64(const std::string& in)
+{
+  std::string out ;
+  uint32_t bits = 0 ;
+  int count = 0 ;
+  for (char c : in) {
+    auto p = std::strchr(alphabet, c) ;
+    if (not c || not p) throw std::invalid_argument("bad cursor token") ;
+    bits = bits << 6 | uint32_t(p - alphabet) ;
+    if ((count += 6) >= 8) out += char(bits >> (count -= 8) & 0xff) ;
+  }
+  return out ;
+}
+
+inline std::string encode(const std::vector<cursor_value>& keys)
+{
+  std::string out ;
+  for (const auto& k : keys) {
+    out += char(k.type) ;
+    if (k.type == SQLITE_INTEGER)
+      varint(out, uint64_t(k.integer) << 1 ^ uint64_t(k.integer >> 63)) ;
+    else if (k.type == SQLITE_FLOAT) {
+      uint64_t bits ;
+      std::memcpy(&bits, &k.real, sizeof bits);
+      varint(out, bits);
+    }
+    else {
+      varint(out, k.text.size());
+      out += k.text ;
+    }
+  }
+  return base64(out) ;
+}
+
+inline std::vector<cursor_value> decode(const std::string& token)
+{
+  const auto in = unbase64(token) ;
+  std::vector<cursor_value> keys ;
+  for (std::size_t pos = 0; pos < in.size(); ) {
+    cursor_value k{in[pos++], 0, 0, {}} ;
+    if (k.type == SQLITE_INTEGER) {
+      auto v = varint(in, pos) ;
+      k.integer = int64_t(v >> 1) ^ -int64_t(v & 1) ;
+    }
+    else if (k.type == SQLITE_FLOAT) {
+      auto bits = varint(in, pos) ;
+      std::memcpy(&k.real, &bits, sizeof bits);
+    }
+    else if (k.type == SQLITE_TEXT || k.type == SQLITE_BLOB) {
+      auto size = varint(in, pos) ;
+      if (size > in.size() - pos) throw std::invalid_argument("bad cursor token") ;
+      k.text = in.substr(pos, size) ;
+      pos += size ;
+    }
+    else throw std::invalid_argument("bad cursor token") ;
+    keys.push_back(k);
+  }
+  return keys ;
+}
+}
+
+// SELECT columns FROM from WHERE where, paged by keys
+struct keyset_shape
+{
+  std::string columns ;
+  std::string from ;
+  std::vector<std::string> keys ;
+  std::string where ;
+};
+
+class keyset_pager
+{
+public:
+  explicit keyset_pager(not_null<sqlite3*> db) : _db{db} {}
+
+  // calls callback for the rows of the page after token ("" for the first
+  // page), returns the token of the next page, "" after the last one
+  std::string page(const keyset_shape& shape, const std::string& token,
+                   int64_t limit, stmt_callback callback) {
+    // an empty page has no last row to make a token from
+    if (limit <= 0) throw std::invalid_argument("page limit must be positive") ;
+    const auto after = token.empty() ? std::vector<cursor_value>{}
+                                     : cursor_token::decode(token) ;
+    if (not after.empty() && after.size() != shape.keys.size())
+      throw std::invalid_argument("cursor token of an other query") ;
+    auto stmt = cached(shape, not after.empty()) ;
+    int index = 1 ;
+    for (const auto& k : after) {
+      if (k.type == SQLITE_INTEGER) parameter(stmt, index++, k.integer) ;
+      else if (k.type == SQLITE_FLOAT) parameter(stmt, index++, k.real) ;
+      else if (k.type == SQLITE_TEXT) parameter(stmt, index++, k.text) ;
+      else sqlite3_bind_blob(stmt, index++, k.text.data(), k.text.size(), SQLITE_TRANSIENT);
+    }
+    // one row more tells if there is a next page
+    parameter(stmt, index, limit + 1) ;
+
+    const int first_key = sqlite3_column_count(stmt) - int(shape.keys.size()) ;
+    std::vector<cursor_value> last(shape.keys.size()) ;
+    int64_t rows = 0 ;
+    bool more = false ;
+    run(stmt, [&](not_null<sqlite3_stmt*> row) {
+      if (rows == limit) {
+        more = true ;
+        return false ;
+      }
+      ++rows ;
+      for (std::size_t k = 0; k < last.size(); ++k) {
+        const int col = first_key + int(k) ;
+        auto& v = last[k] ;
+        v.type = sqlite3_column_type(row, col) ;
+        if (v.type == SQLITE_INTEGER) v.integer = sqlite3_column_int64(row, col) ;
+        else if (v.type == SQLITE_FLOAT) v.real = sqlite3_column_double(row, col) ;
+        else if (v.type == SQLITE_NULL) throw std::invalid_argument("NULL in a page key") ;
+        else v.text.assign((const char*)sqlite3_column_blob(row, col),
+                           sqlite3_column_bytes(row, col)) ;
+      }
+      if (callback && not callback(row)) {
+        more = true ;
+        return false ;
+      }
+      return true ;
+    });
+    return more ? cursor_token::encode(last) : std::string{} ;
+  }
+
+private:
+  sqlite3_stmt* cached(const keyset_shape& shape, bool after) {
+    std::string keys, placeholders ;
+    for (std::size_t i = 0; i < shape.keys.size(); ++i) {
+      keys += (i ? ", " : "") + shape.keys[i] ;
+      placeholders += (i ? ", ?" : "?") + std::to_string(i + 1) ;
+    }
+    std::string where = shape.where ;
+    if (after)
+      where = (where.empty() ? "" : "(" + where + ") AND ")
+            + "(" + keys + ") > (" + placeholders + ")" ;
+    const auto sql = "SELECT " + shape.columns + ", " + keys + " FROM " + shape.from
+                   + (where.empty() ? "" : " WHERE " + where)
+                   + " ORDER BY " + keys + " LIMIT ?"
+                   + std::to_string((after ? shape.keys.size() : 0) + 1) + ";" ;
+    auto it = _statements.find(sql) ;
+    if (it == _statements.end())
+      it = _statements.emplace(sql, create_statement(_db, sql)).first ;
+    return it->second.get() ;
+  }
+
+  sqlite3* _db ;
+  std::unordered_map<std::string, statement> _statements ;
+};
+
+
+void main26()
+{
+  auto db = open_database(":memory:");
+  execute(db.get(), "CREATE TABLE things(id INTEGER PRIMARY KEY, name TEXT,"
+                    " value REAL, bucket INTEGER NOT NULL);");
+  { Transaction transaction(db.get()) ;
+    auto add = create_statement(db.get(),
+          "INSERT INTO things VALUES(?1, 'thing ' || ?1, ?1 * 0.5, ?1 % 100);");
+    for (int64_t i = 1; i <= 200000; ++i) {
+      parameter(add.get(), 1, i);
+      run(add.get());
+    }
+    transaction.commit() ;
+  }
+  execute(db.get(), "CREATE INDEX things_bucket ON things(bucket);");
+
+  auto measure = [](std::function<void()> f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  };
+  const int64_t limit = 1000 ;
+  keyset_pager pager(db.get()) ;
+  const keyset_shape shape{"name, value", "things", {"bucket", "id"}, ""} ;
+  std::string token ;
+  int pages = 0 ;
+  int64_t rows = 0, first_us = 0, last_us = 0 ;
+  std::string first_token ;
+  do {
+    auto us = measure([&]{
+      token = pager.page(shape, token, limit,
+                         [&](not_null<sqlite3_stmt*>) { ++rows ; return true ; });
+    });
+    if (pages++ == 0) {
+      first_us = us ;
+      first_token = token ;
+    }
+    last_us = us ;
+  } while (not token.empty());
+
+  auto offset = create_statement(db.get(), "SELECT name, value FROM things"
+                                           " ORDER BY bucket, id LIMIT ?1 OFFSET ?2;");
+  auto offset_page = [&](int64_t page) {
+    return measure([&]{
+      parameter(offset.get(), 1, limit);
+      parameter(offset.get(), 2, page * limit);
+      run(offset.get(), [](not_null<sqlite3_stmt*>) { return true ; });
+    });
+  };
+  try {
+    pager.page(shape, first_token, 0, stmt_callback{});
+  }
+  catch (const std::invalid_argument& e) {
+    std::cout << "limit 0: " << e.what() << "\n" ;
+  }
+  std::cout << pages << " pages, " << rows << " rows, token of page 2 '"
+            << first_token << "'\nkeyset: page 1 " << first_us << "us, page "
+            << pages << " " << last_us << "us\noffset: page 1 " << offset_page(0)
+            << "us, page " << pages << " " << offset_page(pages - 1) << "us\n" ;
+}
+
+
 int main()
 {
   main1();
+  main2();
+  main3();
+  main4();
+  main5();
+  main6();
+  main7();
+  main8();
+  main9();
+  main10();
+  main11();
+  main12();
+  main13();
+  main14();
+  main15();
+  main16();
+  main17();
+  main18();
+  main19();
+  main20();
+  main21();
+  main22();
+  main23();
+  main24();
+  main25();
+  main26();
 }
 
@@ -0,0 +1,229 @@
+//
+// schemagen, row structs and decoders from a database schema
+//
+//   schemagen things.sql > things_rows.h
+//
+// runs the schema on an in-memory database and, for every table, writes
+//   <table>_row       owned values
+//   <table>_row_view  text and blobs as text_view, valid until the next
+//                     step of the statement
+//   <table>_create    the CREATE TABLE statement
+//   <table>_select    SELECT of all columns, in the order the decoders use
+//   decode_<table>_row(stmt), decode_<table>_row_view(stmt)
+// the decoders read each column once, by fixed index.
+// C++ types follow the column affinity, INTEGER int64_t, REAL and NUMERIC
+// double, TEXT and BLOB std::string. NULL decodes as 0 or empty.
+// text_view has to be declared before the header is included.
+//
+#include <memory>
+#include <cstdlib>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <set>
+#include <sqlite3.h>
+
+using database = std::unique_ptr<sqlite3, decltype(&sqlite3_close)> ;
+using statement = std::unique_ptr<sqlite3_stmt, decltype(&sqlite3_finalize)> ;
+
+void fail(sqlite3* db, const std::string& what)
+{
+  std::cerr << what << ": " << sqlite3_errmsg(db) << "\n" ;
+  std::exit(EXIT_FAILURE);
+}
+
+statement create_statement(sqlite3* db, const std::string& sql)
+{
+  sqlite3_stmt* stmt = nullptr;
+  if (sqlite3_prepare_v2(db, sql.c_str(), sql.size(), &stmt, nullptr) != SQLITE_OK)
+    fail(db, "Unable to create statement '" + sql + "'");
+  return statement(stmt, sqlite3_finalize);
+}
+
+std::string text(sqlite3_stmt* stmt, int col)
+{
+  auto first = (const char*)sqlite3_column_text(stmt, col);
+  return first ? std::string(first, sqlite3_column_bytes(stmt, col)) : std::string{};
+}
+
+struct column
+{
+  std::string name ;
+  std::string type ;
+};
+
+enum class affinity { integer, text, blob, real, numeric } ;
+
+// the rules of https://sqlite.org/datatype3.html#determination_of_column_affinity
+affinity affinity_of(std::string type)
+{
+  std::transform(type.begin(), type.end(), type.begin(), ::toupper);
+  auto has = [&](const char* s) { return type.find(s) != std::string::npos ; };
+  if (has("INT")) return affinity::integer ;
+  if (has("CHAR") || has("CLOB") || has("TEXT")) return affinity::text ;
+  if (has("BLOB") || type.empty()) return affinity::blob ;
+  if (has("REAL") || has("FLOA") || has("DOUB")) return affinity::real ;
+  return affinity::numeric ;
+}
+
+bool keyword(const std::string& id)
+{
+  static const std::set<std::string> keywords{
+    "alignas", "alignof", "and", "and_eq", "asm", "auto", "bitand", "bitor",
+    "bool", "break", "case", "catch", "char", "char16_t", "char32_t", "class",
+    "compl", "const", "constexpr", "const_cast", "continue", "decltype",
+    "default", "delete", "do", "double", "dynamic_cast", "else", "enum",
+    "explicit", "export", "extern", "false", "float", "for", "friend", "goto",
+    "if", "inline", "int", "long", "mutable", "namespace", "new", "noexcept",
+    "not", "not_eq", "nullptr", "operator", "or", "or_eq", "private",
+    "protected", "public", "register", "reinterpret_cast", "return", "short",
+    "signed", "sizeof", "static", "static_assert", "static_cast", "struct",
+    "switch", "template", "this", "thread_local", "throw", "true", "try",
+    "typedef", "typeid", "typename", "union", "unsigned", "using", "virtual",
+    "void", "volatile", "wchar_t", "while", "xor", "xor_eq"
+  } ;
+  return keywords.count(id) > 0 ;
+}
+
+// names are used as C++ identifiers, unique within taken
+std::string identifier(const std::string& name, std::set<std::string>& taken)
+{
+  std::string id ;
+  for (char c : name)
+    id += std::isalnum(static_cast<unsigned char>(c)) ? c : '_' ;
+  if (id.empty() || std::isdigit(static_cast<unsigned char>(id[0]))) id = "_" + id ;
+  if (keyword(id)) id += "_" ;
+  auto unique = id ;
+  for (int n = 2; not taken.insert(unique).second; ++n)
+    unique = id + "_" + std::to_string(n) ;
+  return unique ;
+}
+
+std::string quoted(const std::string& sql)
+{
+  std::string q = "\"" ;
+  for (char c : sql) {
+    if (c == '"' || c == '\\') q += '\\' ;
+    if (c == '\n') q += "\\n" ;
+    else q += c ;
+  }
+  return q + "\"" ;
+}
+
+std::string quoted_name(const std::string& name)
+{
+  std::string q = "\\\"" ;
+  for (char c : name) q += c == '"' ? std::string("\\\"\\\"") : std::string(1, c) ;
+  return q + "\\\"" ;
+}
+
+void generate(std::ostream& out,
+              const std::string& t,
+              const std::string& table,
+              const std::string& create,
+              const std::vector<column>& columns)
+{
+  std::string names ;
+  std::set<std::string> taken ;
+  std::vector<std::string> members ;
+  for (const auto& c : columns) {
+    names += (names.empty() ? "" : ", ") + quoted_name(c.name) ;
+    members.push_back(identifier(c.name, taken));
+  }
+
+  auto member = [&](const column& c, bool view) {
+    switch (affinity_of(c.type)) {
+      case affinity::integer: return std::string("int64_t") ;
+      case affinity::real:
+      case affinity::numeric: return std::string("double") ;
+      default: return std::string(view ? "text_view" : "std::string") ;
+    }
+  };
+  auto decode = [&](const column& c, std::size_t i, bool view) {
+    const auto field = "  row." + members[i] ;
+    const auto col = std::to_string(i) ;
+    switch (affinity_of(c.type)) {
+      case affinity::integer:
+        return field + " = sqlite3_column_int64(stmt, " + col + ") ;\n" ;
+      case affinity::real:
+      case affinity::numeric:
+        return field + " = sqlite3_column_double(stmt, " + col + ") ;\n" ;
+      default: {
+        const auto get = affinity_of(c.type) == affinity::text
+            ? "(const char*)sqlite3_column_text(stmt, " + col + ")"
+            : "(const char*)sqlite3_column_blob(stmt, " + col + ")" ;
+        const auto size = "std::size_t(sqlite3_column_bytes(stmt, " + col + "))" ;
+        if (view)
+          return field + " = text_view{" + get + ", " + size + "} ;\n" ;
+        return "  if (auto first = " + get + ")\n  "
+             + field + ".assign(first, " + size + ") ;\n" ;
+      }
+    }
+  };
+
+  out << "\n// " << table << "\n" ;
+  for (bool view : {false, true}) {
+    out << "struct " << t << (view ? "_row_view" : "_row") << "\n{\n" ;
+    for (std::size_t i = 0; i < columns.size(); ++i)
+      out << "  " << member(columns[i], view) << " " << members[i] << " ;\n" ;
+    out << "};\n\n" ;
+  }
+  out << "constexpr const char* " << t << "_create =\n    "
+      << quoted(create + ";") << " ;\n"
+      << "constexpr const char* " << t << "_select =\n    \"SELECT " << names
+      << " FROM " << quoted_name(table) << "\" ;\n" ;
+  for (bool view : {false, true}) {
+    const auto type = t + (view ? "_row_view" : "_row") ;
+    out << "\ninline " << type << " decode_" << type << "(sqlite3_stmt* stmt)\n{\n"
+        << "  " << type << " row" << (view ? "" : "{}") << " ;\n" ;
+    for (std::size_t i = 0; i < columns.size(); ++i)
+      out << decode(columns[i], i, view) ;
+    out << "  return row ;\n}\n" ;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc != 2) {
+    std::cerr << "usage: " << argv[0] << " schema.sql > header.h\n" ;
+    return EXIT_FAILURE ;
+  }
+  std::ifstream file(argv[1]);
+  if (not file) {
+    std::cerr << "Unable to read " << argv[1] << "\n" ;
+    return EXIT_FAILURE ;
+  }
+  std::stringstream schema ;
+  schema << file.rdbuf() ;
+
+  sqlite3* raw = nullptr ;
+  auto rc = sqlite3_open(":memory:", &raw);
+  database db(raw, sqlite3_close);
+  if (rc != SQLITE_OK) fail(db.get(), "Unable to open an in-memory database");
+  if (sqlite3_exec(db.get(), schema.str().c_str(), nullptr, nullptr, nullptr) != SQLITE_OK)
+    fail(db.get(), std::string("Unable to run ") + argv[1]);
+
+  std::cout << "// generated from " << argv[1] << " by schemagen, do not edit\n"
+            << "#pragma once\n" ;
+  auto tables = create_statement(db.get(),
+        "SELECT name, sql FROM sqlite_master WHERE type = 'table'"
+        " AND name NOT LIKE 'sqlite_%' AND sql NOT LIKE 'CREATE VIRTUAL%'"
+        " ORDER BY name;");
+  auto info = create_statement(db.get(),
+        "SELECT name, type FROM pragma_table_info(?1) ORDER BY cid;");
+  std::set<std::string> taken ;
+  while (sqlite3_step(tables.get()) == SQLITE_ROW) {
+    const auto table = text(tables.get(), 0) ;
+    std::vector<column> columns ;
+    sqlite3_bind_text(info.get(), 1, table.c_str(), table.size(), SQLITE_TRANSIENT);
+    while (sqlite3_step(info.get()) == SQLITE_ROW)
+      columns.push_back(column{text(info.get(), 0), text(info.get(), 1)});
+    sqlite3_reset(info.get());
+    generate(std::cout, identifier(table, taken), table, text(tables.get(), 1), columns);
+  }
+  return EXIT_SUCCESS ;
+}